@@ -0,0 +1,134 @@
+// libFuzzer target, feeds arbitrary bytes into the hs1 packet and ft1 handlers
+// runs without tox, on the answers the replay uses (see NGC_HS1_replay_trace)
+// eg: clang++ -std=c++17 -g -O1 -fsanitize=fuzzer,address,undefined -I<tox/ext/ft1 includes> fuzz/ngc_hs1_fuzz.cpp ngc_hs1.cpp -lsodium
+
+#include "../ngc_hs1.hpp"
+
+#include <cstdint>
+#include <algorithm>
+#include <vector>
+
+static constexpr uint32_t _fuzz_peer_count {4};
+
+static void _fuzz_message_cb(Tox*, uint32_t, uint32_t, Tox_Message_Type, const uint8_t*, size_t, uint32_t) {
+}
+
+// missing bytes are 0
+template<typename T>
+static T _fuzz_take(const uint8_t*& data, size_t& size) {
+	T value {};
+	const size_t n = std::min(sizeof(T), size);
+	// HACK: little endian
+	std::copy(data, data+n, reinterpret_cast<uint8_t*>(&value));
+	data += n;
+	size -= n;
+	return value;
+}
+
+static NGC_EXT::PeerKey _fuzz_peer_key(uint32_t peer_number) {
+	NGC_EXT::PeerKey p_key{};
+	p_key.data[0] = peer_number + 1;
+	return p_key;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+	NGC_HS1_options options{};
+	options.default_trust_level = 0;
+	options.record_others = true;
+	options.query_interval_per_peer = 1.f;
+	options.last_msg_ids_count = 5;
+	options.ft_activity_timeout = 5.f;
+	options.digest_sync = true;
+	options.push_new_ids = true;
+
+	NGC_HS1* ngc_hs1_ctx = NGC_HS1_new(&options);
+	ngc_hs1_ctx->cb_group_message = _fuzz_message_cb;
+
+	// one group with a few peers, the keys are easy to guess
+	auto& trace = ngc_hs1_ctx->trace;
+	trace.replaying = true;
+	trace.connected_groups = {0};
+	trace.chat_ids[0] = NGC_EXT::GroupKey{};
+	trace.self_keys[0] = _fuzz_peer_key(_fuzz_peer_count);
+	for (uint32_t peer_number = 0; peer_number < _fuzz_peer_count; peer_number++) {
+		trace.peer_keys[peer_number] = _fuzz_peer_key(peer_number);
+		NGC_HS1_peer_online(nullptr, ngc_hs1_ctx, 0, peer_number, true);
+	}
+
+	// something to serve
+	NGC_HS1_record_message(nullptr, ngc_hs1_ctx, 0, 1, TOX_MESSAGE_TYPE_NORMAL, reinterpret_cast<const uint8_t*>("hello"), 5, 1);
+	NGC_HS1_record_own_message(nullptr, ngc_hs1_ctx, 0, TOX_MESSAGE_TYPE_ACTION, reinterpret_cast<const uint8_t*>("waves"), 5, 2);
+
+	// commands
+	// - 1 byte what
+	// - 1 byte peer_number
+	// - 2 bytes size
+	// - size bytes (fields first, variable size data takes the rest)
+	while (size >= 4) {
+		const uint8_t what = _fuzz_take<uint8_t>(data, size);
+		const uint32_t peer_number = _fuzz_take<uint8_t>(data, size) % (_fuzz_peer_count + 1); // one unknown
+		size_t length = std::min<size_t>(_fuzz_take<uint16_t>(data, size), size);
+		const uint8_t* payload = data;
+		data += length;
+		size -= length;
+
+		switch (what % 11) {
+			case 0:
+				_handle_HS1_REQUEST_LAST_IDS(nullptr, nullptr, 0, peer_number, payload, length, ngc_hs1_ctx);
+				break;
+			case 1:
+				_handle_HS1_RESPONSE_LAST_IDS(nullptr, nullptr, 0, peer_number, payload, length, ngc_hs1_ctx);
+				break;
+			case 2:
+				_handle_HS1_REQUEST_DIGEST(nullptr, nullptr, 0, peer_number, payload, length, ngc_hs1_ctx);
+				break;
+			case 3:
+				_handle_HS1_RESPONSE_DIGEST(nullptr, nullptr, 0, peer_number, payload, length, ngc_hs1_ctx);
+				break;
+			case 4: {
+				// what ft1 answers to the init
+				const uint8_t transfer_id = _fuzz_take<uint8_t>(payload, length);
+				trace.ft_inits.emplace_back(what & 0x80, transfer_id);
+				_handle_HS1_ft_recv_request(nullptr, 0, peer_number, payload, length, ngc_hs1_ctx);
+				trace.ft_inits.clear();
+				break;
+			}
+			case 5: {
+				const uint8_t transfer_id = _fuzz_take<uint8_t>(payload, length);
+				const uint32_t file_size = _fuzz_take<uint32_t>(payload, length);
+				_handle_HS1_ft_recv_init(nullptr, 0, peer_number, payload, length, transfer_id, file_size, ngc_hs1_ctx);
+				break;
+			}
+			case 6: {
+				const uint8_t transfer_id = _fuzz_take<uint8_t>(payload, length);
+				const uint32_t data_offset = _fuzz_take<uint32_t>(payload, length);
+				_handle_HS1_ft_recv_data(nullptr, 0, peer_number, transfer_id, data_offset, payload, length, ngc_hs1_ctx);
+				break;
+			}
+			case 7: {
+				const uint8_t transfer_id = _fuzz_take<uint8_t>(payload, length);
+				const uint32_t data_offset = _fuzz_take<uint32_t>(payload, length);
+				std::vector<uint8_t> buffer(_fuzz_take<uint16_t>(payload, length));
+				_handle_HS1_ft_send_data(nullptr, 0, peer_number, transfer_id, data_offset, buffer.data(), buffer.size(), ngc_hs1_ctx);
+				break;
+			}
+			case 8:
+				// up to ~16s, so the timers fire
+				trace.replay_time_delta = _fuzz_take<uint8_t>(payload, length) / 16.f;
+				NGC_HS1_iterate(nullptr, ngc_hs1_ctx);
+				break;
+			case 9:
+				NGC_HS1_peer_online(nullptr, ngc_hs1_ctx, 0, peer_number, what & 0x80);
+				break;
+			case 10: {
+				const uint32_t msg_id = _fuzz_take<uint32_t>(payload, length);
+				NGC_HS1_record_message(nullptr, ngc_hs1_ctx, 0, peer_number, TOX_MESSAGE_TYPE_NORMAL, payload, length, msg_id);
+				break;
+			}
+		}
+	}
+
+	NGC_HS1_kill(ngc_hs1_ctx);
+
+	return 0;
+}
@@ -1,5 +1,7 @@
 #include "./ngc_hs1.hpp"
 
+#include <sodium.h>
+
 #include <cstdint>
 #include <cassert>
 #include <new>
@@ -7,87 +9,1240 @@
 #include <list>
 #include <set>
 #include <optional>
+#include <tuple>
+#include <type_traits>
 #include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <iterator>
+#include <filesystem>
+#include <cstdio>
+
+#ifdef _WIN32
+	#include <io.h>
+#else
+	#include <unistd.h>
+#endif
+
+// lowercase ascii, everything that is not ascii alnum splits words (utf8 bytes are kept as word bytes)
+static std::set<std::string> _hs1_split_words(const char* text, size_t length) {
+	std::set<std::string> words;
+
+	std::string word;
+	for (size_t i = 0; i <= length; i++) {
+		const uint8_t c = i < length ? static_cast<uint8_t>(text[i]) : ' ';
+		if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c >= 0x80) {
+			word.push_back(c);
+		} else if (c >= 'A' && c <= 'Z') {
+			word.push_back(c - 'A' + 'a');
+		} else if (!word.empty()) {
+			words.emplace(std::move(word));
+			word.clear();
+		}
+	}
+
+	return words;
+}
+
+static std::string _hs1_hex(const uint8_t* data, size_t size) {
+	static const char* digits = "0123456789ABCDEF";
+	std::string hex;
+	hex.reserve(size*2);
+	for (size_t i = 0; i < size; i++) {
+		hex.push_back(digits[data[i] >> 4]);
+		hex.push_back(digits[data[i] & 0x0f]);
+	}
+	return hex;
+}
+
+static bool _hs1_unhex(const std::string& hex, uint8_t* data, size_t size) {
+	if (hex.size() != size*2) {
+		return false;
+	}
+
+	for (size_t i = 0; i < hex.size(); i++) {
+		const char c = hex[i];
+		uint8_t nibble;
+		if (c >= '0' && c <= '9') {
+			nibble = c - '0';
+		} else if (c >= 'A' && c <= 'F') {
+			nibble = c - 'A' + 10;
+		} else if (c >= 'a' && c <= 'f') {
+			nibble = c - 'a' + 10;
+		} else {
+			return false;
+		}
+
+		if (i % 2 == 0) {
+			data[i/2] = nibble << 4;
+		} else {
+			data[i/2] |= nibble;
+		}
+	}
+
+	return true;
+}
+
+// storage record:
+// - 4 bytes msg_id
+// - 1 byte msg_type
+// - 8 bytes timestamp
+// - 4 bytes text length
+// - x bytes text
+// HACK: little endian
+static void _hs1_storage_serialize(std::vector<uint8_t>& out, const NGC_HS1::Message& msg) {
+	const auto put = [&out](const void* data, size_t size) {
+		const uint8_t* tmp_ptr = static_cast<const uint8_t*>(data);
+		out.insert(out.end(), tmp_ptr, tmp_ptr+size);
+	};
+
+	const uint8_t type = msg.type;
+	const uint32_t text_size = msg.text.size();
+
+	put(&msg.msg_id, sizeof(msg.msg_id));
+	put(&type, sizeof(type));
+	put(&msg.timestamp, sizeof(msg.timestamp));
+	put(&text_size, sizeof(text_size));
+	put(msg.text.data(), text_size);
+}
+
+// the text is only read if want_text(msg_id) (otherwise left empty)
+// offset: optional, advanced by the size of the record
+// returns false at the end of the file or on a truncated record
+static bool _hs1_storage_read_record(FILE* file, const std::function<bool(uint32_t)>& want_text, NGC_HS1::Message& msg, uint64_t* offset = nullptr) {
+	uint8_t type {0};
+	uint32_t text_size {0};
+
+	if (
+		fread(&msg.msg_id, sizeof(msg.msg_id), 1, file) != 1 ||
+		fread(&type, sizeof(type), 1, file) != 1 ||
+		fread(&msg.timestamp, sizeof(msg.timestamp), 1, file) != 1 ||
+		fread(&text_size, sizeof(text_size), 1, file) != 1
+	) {
+		return false;
+	}
+	msg.type = static_cast<Tox_Message_Type>(type);
+
+	if (offset != nullptr) {
+		*offset += sizeof(msg.msg_id) + sizeof(type) + sizeof(msg.timestamp) + sizeof(text_size) + text_size;
+	}
+
+	if (want_text(msg.msg_id)) {
+		// in pieces, so a broken text_size cant make us allocate more than the file has
+		msg.text.clear();
+		while (msg.text.size() < text_size) {
+			const size_t offset = msg.text.size();
+			const size_t piece = std::min<size_t>(text_size - offset, 64*1024);
+			msg.text.resize(offset + piece);
+			if (fread(msg.text.data()+offset, piece, 1, file) != 1) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	msg.text.clear();
+	return fseek(file, text_size, SEEK_CUR) == 0;
+}
+
+// calls fn for each record in file order, with the offset the record starts at
+// a truncated last record is ignored
+static bool _hs1_storage_read(
+	const std::string& path,
+	const std::function<bool(uint32_t)>& want_text,
+	const std::function<void(NGC_HS1::Message&&, uint64_t)>& fn
+) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return false;
+	}
+
+	NGC_HS1::Message msg;
+	uint64_t offset = 0;
+	for (uint64_t record_offset = offset; _hs1_storage_read_record(file, want_text, msg, &offset); record_offset = offset) {
+		fn(std::move(msg), record_offset);
+	}
+
+	fclose(file);
+	return true;
+}
+
+// flush and make it durable
+static bool _hs1_storage_sync(FILE* file) {
+	if (fflush(file) != 0) {
+		return false;
+	}
+
+#ifdef _WIN32
+	return _commit(_fileno(file)) == 0;
+#else
+	return fsync(fileno(file)) == 0;
+#endif
+}
+
+// reads the one record at offset (see Peer::evicted_offsets)
+static std::optional<NGC_HS1::Message> _hs1_storage_read_at(const std::string& path, uint64_t offset, uint32_t msg_id) {
+	FILE* file = fopen(path.c_str(), "rb");
+	if (file == nullptr) {
+		return std::nullopt;
+	}
+
+	std::optional<NGC_HS1::Message> found;
+	NGC_HS1::Message msg;
+	if (
+		fseek(file, offset, SEEK_SET) == 0 &&
+		_hs1_storage_read_record(file, [](uint32_t) { return true; }, msg) &&
+		msg.msg_id == msg_id
+	) {
+		found = std::move(msg);
+	}
+
+	fclose(file);
+	return found;
+}
+
+// file_id of NGC_HS1_MESSAGE_BY_ID
+// - peer_key bytes (the msg_id is from)
+// - msg_id bytes
+// - optional, only if not 0:
+//   - 4 bytes offset (resume, the file starts at this byte of the message)
+//     only sent to peers with NGC_HS1_EXT::HS1_CAP_RESUME, older versions would send the whole message
+static std::vector<uint8_t> _hs1_make_file_id(const NGC_EXT::PeerKey& peer_key, uint32_t msg_id, uint32_t offset) {
+	std::vector<uint8_t> file_id{peer_key.data.cbegin(), peer_key.data.cend()};
+
+	// HACK: little endian
+	file_id.insert(file_id.end(), reinterpret_cast<const uint8_t*>(&msg_id), reinterpret_cast<const uint8_t*>(&msg_id)+sizeof(msg_id));
+	if (offset != 0) {
+		file_id.insert(file_id.end(), reinterpret_cast<const uint8_t*>(&offset), reinterpret_cast<const uint8_t*>(&offset)+sizeof(offset));
+	}
+
+	return file_id;
+}
+
+// returns peer_key, msg_id and offset
+static std::optional<std::tuple<NGC_EXT::PeerKey, uint32_t, uint32_t>> _hs1_parse_file_id(const uint8_t* file_id, size_t file_id_size) {
+	if (
+		file_id == nullptr || (
+			file_id_size != TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t) &&
+			file_id_size != TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t)+sizeof(uint32_t)
+		)
+	) {
+		return std::nullopt;
+	}
+
+	std::tuple<NGC_EXT::PeerKey, uint32_t, uint32_t> ret{};
+	auto& [peer_key, msg_id, offset] = ret;
+	std::copy(file_id, file_id+peer_key.size(), peer_key.data.begin());
+	size_t curser = peer_key.size();
+
+	// HACK: little endian
+	std::copy(file_id+curser, file_id+curser+sizeof(msg_id), reinterpret_cast<uint8_t*>(&msg_id));
+	curser += sizeof(msg_id);
+
+	if (curser < file_id_size) {
+		std::copy(file_id+curser, file_id+curser+sizeof(offset), reinterpret_cast<uint8_t*>(&offset));
+	}
+
+	return ret;
+}
+
+// ========== trace ==========
+
+// variable size data, last in an event
+using _hs1_bytes = std::pair<const uint8_t*, size_t>;
+
+template<typename T>
+static void _trace_put(std::vector<uint8_t>& out, const T& value) {
+	static_assert(std::is_trivially_copyable_v<T>);
+	// HACK: little endian
+	out.insert(out.end(), reinterpret_cast<const uint8_t*>(&value), reinterpret_cast<const uint8_t*>(&value)+sizeof(T));
+}
+
+static void _trace_put(std::vector<uint8_t>& out, const _hs1_bytes& bytes) {
+	if (bytes.second != 0) {
+		out.insert(out.end(), bytes.first, bytes.first+bytes.second);
+	}
+}
+
+// noop if not tracing
+template<typename... Args>
+static void _trace(NGC_HS1* ngc_hs1_ctx, NGC_HS1::Trace::Event event, const Args&... args) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.file == nullptr) {
+		return;
+	}
+
+	auto& buffer = trace.buffer;
+	buffer.push_back(event);
+	const size_t size_pos = buffer.size();
+	buffer.resize(buffer.size()+sizeof(uint32_t));
+
+	(_trace_put(buffer, args), ...);
+
+	const uint32_t size = buffer.size() - size_pos - sizeof(uint32_t);
+	// HACK: little endian
+	std::copy(reinterpret_cast<const uint8_t*>(&size), reinterpret_cast<const uint8_t*>(&size)+sizeof(size), buffer.begin()+size_pos);
+}
+
+static void _trace_flush(NGC_HS1* ngc_hs1_ctx) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.file == nullptr || trace.buffer.empty()) {
+		return;
+	}
+
+	if (fwrite(trace.buffer.data(), 1, trace.buffer.size(), trace.file) != trace.buffer.size()) {
+		fprintf(stderr, "HS: error, failed to write trace, stopping it\n");
+		fclose(trace.file);
+		trace.file = nullptr;
+	}
+	trace.buffer.clear();
+}
+
+// ========== tox ==========
+// all tox and ft1 calls go through here, so they can be traced and replayed without tox
+
+static void _hs1_group_get_chat_id(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, NGC_EXT::GroupKey& g_id) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		const auto it = trace.chat_ids.find(group_number);
+		g_id = it != trace.chat_ids.end() ? it->second : NGC_EXT::GroupKey{};
+		return;
+	}
+
+	tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+
+	if (trace.file != nullptr) {
+		auto [it, is_new] = trace.chat_ids.try_emplace(group_number, g_id);
+		if (is_new || it->second.data != g_id.data) {
+			it->second = g_id;
+			_trace(ngc_hs1_ctx, NGC_HS1::Trace::GROUP_CHAT_ID, group_number, _hs1_bytes{g_id.data.data(), g_id.size()});
+		}
+	}
+}
+
+static void _hs1_group_peer_get_public_key(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number, NGC_EXT::PeerKey& p_id) {
+	auto& trace = ngc_hs1_ctx->trace;
+	const uint64_t key = uint64_t(group_number) << 32 | peer_number;
+	if (trace.replaying) {
+		const auto it = trace.peer_keys.find(key);
+		p_id = it != trace.peer_keys.end() ? it->second : NGC_EXT::PeerKey{};
+		return;
+	}
+
+	tox_group_peer_get_public_key(tox, group_number, peer_number, p_id.data.data(), nullptr);
+
+	if (trace.file != nullptr) {
+		auto [it, is_new] = trace.peer_keys.try_emplace(key, p_id);
+		if (is_new || it->second.data != p_id.data) {
+			it->second = p_id;
+			_trace(ngc_hs1_ctx, NGC_HS1::Trace::PEER_PUBLIC_KEY, group_number, peer_number, _hs1_bytes{p_id.data.data(), p_id.size()});
+		}
+	}
+}
+
+static void _hs1_group_self_get_public_key(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, NGC_EXT::PeerKey& p_id) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		const auto it = trace.self_keys.find(group_number);
+		p_id = it != trace.self_keys.end() ? it->second : NGC_EXT::PeerKey{};
+		return;
+	}
+
+	tox_group_self_get_public_key(tox, group_number, p_id.data.data(), nullptr);
+
+	if (trace.file != nullptr) {
+		auto [it, is_new] = trace.self_keys.try_emplace(group_number, p_id);
+		if (is_new || it->second.data != p_id.data) {
+			it->second = p_id;
+			_trace(ngc_hs1_ctx, NGC_HS1::Trace::SELF_PUBLIC_KEY, group_number, _hs1_bytes{p_id.data.data(), p_id.size()});
+		}
+	}
+}
+
+// returns false if the peer was not found
+static bool _hs1_group_peer_get_role(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number, Tox_Group_Role& role) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		const auto it = trace.roles.find(uint64_t(group_number) << 32 | peer_number);
+		if (it == trace.roles.end() || it->second == 0xff) {
+			return false;
+		}
+		role = static_cast<Tox_Group_Role>(it->second);
+		return true;
+	}
+
+	Tox_Err_Group_Peer_Query err {TOX_ERR_GROUP_PEER_QUERY_OK};
+	role = tox_group_peer_get_role(tox, group_number, peer_number, &err);
+	const bool found = err == TOX_ERR_GROUP_PEER_QUERY_OK;
+
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::PEER_ROLE, group_number, peer_number, static_cast<uint8_t>(found ? role : 0xff));
+
+	return found;
+}
+
+static std::vector<uint32_t> _hs1_connected_groups(const Tox* tox, NGC_HS1* ngc_hs1_ctx) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		return trace.connected_groups;
+	}
+
+	std::vector<uint32_t> groups;
+
+	uint32_t group_count = tox_group_get_number_groups(tox);
+	// this can loop endless if toxcore misbehaves
+	for (uint32_t g_i = 0, g_c_done = 0; g_c_done < group_count; g_i++) {
+		Tox_Err_Group_Is_Connected g_err;
+		if (tox_group_is_connected(tox, g_i, &g_err)) {
+			// valid and connected here
+			groups.push_back(g_i);
+			g_c_done++;
+		} else if (g_err != TOX_ERR_GROUP_IS_CONNECTED_GROUP_NOT_FOUND) {
+			g_c_done++;
+		} // else do nothing
+
+		// safety
+		if (g_i > group_count + 1000) {
+			fprintf(stderr, "HS: WAY PAST GOUPS in iterate\n");
+			break;
+		}
+	}
+
+	if (trace.file != nullptr && groups != trace.connected_groups) {
+		trace.connected_groups = groups;
+		_trace(ngc_hs1_ctx, NGC_HS1::Trace::CONNECTED_GROUPS, _hs1_bytes{reinterpret_cast<const uint8_t*>(groups.data()), groups.size()*sizeof(uint32_t)});
+	}
+
+	return groups;
+}
+
+// to the whole group, or privately if peer_number is set
+static void _hs1_group_send_custom_packet(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, std::optional<uint32_t> peer_number, const std::vector<uint8_t>& data) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		trace.replay_packets_sent++;
+		trace.replay_bytes_sent += data.size();
+		return;
+	}
+
+	if (peer_number.has_value()) {
+		tox_group_send_custom_private_packet(tox, group_number, peer_number.value(), true, data.data(), data.size(), nullptr);
+	} else {
+		tox_group_send_custom_packet(tox, group_number, true, data.data(), data.size(), nullptr);
+	}
+}
+
+static void _hs1_ft_send_request(Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number, const std::vector<uint8_t>& file_id) {
+	if (ngc_hs1_ctx->trace.replaying) {
+		return;
+	}
+
+	NGC_FT1_send_request_private(
+		tox, ngc_hs1_ctx->ngc_ft1_ctx,
+		group_number, peer_number,
+		NGC_FT1_file_kind::NGC_HS1_MESSAGE_BY_ID,
+		file_id.data(), file_id.size()
+	);
+}
+
+static bool _hs1_ft_send_init(
+	Tox* tox, NGC_HS1* ngc_hs1_ctx,
+	uint32_t group_number, uint32_t peer_number,
+	const uint8_t* file_id, size_t file_id_size,
+	size_t file_size,
+	uint8_t& transfer_id
+) {
+	auto& trace = ngc_hs1_ctx->trace;
+	if (trace.replaying) {
+		if (trace.ft_inits.empty()) {
+			return false;
+		}
+		const auto [ok, recorded_transfer_id] = trace.ft_inits.front();
+		trace.ft_inits.pop_front();
+		transfer_id = recorded_transfer_id;
+		return ok;
+	}
+
+	const bool ok = NGC_FT1_send_init_private(
+		tox, ngc_hs1_ctx->ngc_ft1_ctx,
+		group_number, peer_number,
+		NGC_HS1_MESSAGE_BY_ID,
+		file_id, file_id_size,
+		file_size,
+		&transfer_id
+	);
+
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::FT_INIT_SENT, static_cast<uint8_t>(ok), transfer_id);
+
+	return ok;
+}
+
+void NGC_HS1::Peer::append(uint32_t msg_id, Tox_Message_Type type, const std::string& text, bool update_index) {
+	load(update_index);
+
+	store({
+		msg_id,
+		type,
+		text,
+		static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count())
+	}, update_index);
+
+	fprintf(stderr, "HS: ######## last msgs ########\n");
+	auto rit = order.crbegin();
+	for (size_t i = 0; i < 10 && rit != order.crend(); i++, rit++) {
+		const auto& text = dict.at(*rit).text;
+		fprintf(stderr, "  %08X - %.*s\n", *rit, static_cast<int>(text.size()), text.data());
+	}
+}
+
+NGC_HS1::Digest::Hash NGC_HS1::Digest::message_hash(const Message& msg) {
+	// - msg_id bytes
+	// - 1 byte msg_type
+	// - x bytes msg_text
+	// HACK: little endian
+	std::vector<uint8_t> buffer(sizeof(msg.msg_id) + 1);
+	std::copy(reinterpret_cast<const uint8_t*>(&msg.msg_id), reinterpret_cast<const uint8_t*>(&msg.msg_id)+sizeof(msg.msg_id), buffer.begin());
+	buffer[sizeof(msg.msg_id)] = msg.type;
+	buffer.insert(buffer.end(), msg.text.cbegin(), msg.text.cend());
+
+	Hash hash;
+	crypto_generichash(hash.data(), hash.size(), buffer.data(), buffer.size(), nullptr, 0);
+	return hash;
+}
+
+void NGC_HS1::Digest::toggle(uint32_t msg_id, const Hash& msg_hash) {
+	const uint16_t bucket = msg_id >> 16;
+
+	{ // bucket
+		auto& bucket_hash = nodes[uint32_t(bucket_level) << 16 | bucket];
+		bool all_zero = true;
+		for (size_t i = 0; i < bucket_hash.size(); i++) {
+			bucket_hash[i] ^= msg_hash[i];
+			all_zero = all_zero && bucket_hash[i] == 0;
+		}
+		if (all_zero) {
+			nodes.erase(uint32_t(bucket_level) << 16 | bucket);
+		}
+	}
+
+	// path to the root, each node hashes its 16 children
+	for (int level = bucket_level-1; level >= 0; level--) {
+		const uint16_t prefix = bucket >> (4 * (bucket_level - level));
+
+		std::array<uint8_t, 16*sizeof(Hash)> children{};
+		bool all_zero = true;
+		for (uint16_t i = 0; i < 16; i++) {
+			auto it = nodes.find(uint32_t(level+1) << 16 | (prefix << 4 | i));
+			if (it != nodes.end()) {
+				std::copy(it->second.cbegin(), it->second.cend(), children.begin() + i*sizeof(Hash));
+				all_zero = false;
+			}
+		}
+
+		const uint32_t key = uint32_t(level) << 16 | prefix;
+		if (all_zero) {
+			nodes.erase(key);
+		} else {
+			auto& hash = nodes[key];
+			crypto_generichash(hash.data(), hash.size(), children.data(), children.size(), nullptr, 0);
+		}
+	}
+}
+
+NGC_HS1::Digest::Hash NGC_HS1::Digest::node(uint8_t level, uint16_t prefix) const {
+	auto it = nodes.find(uint32_t(level) << 16 | prefix);
+	if (it == nodes.end()) {
+		return {};
+	}
+	return it->second;
+}
+
+void NGC_HS1::Peer::QueryIndex::add(const Message& msg) {
+	for (auto& word : _hs1_split_words(msg.text.data(), msg.text.size())) {
+		words[word].emplace(msg.msg_id);
+	}
+	by_time.emplace(msg.timestamp, msg.msg_id);
+	timestamps[msg.msg_id] = msg.timestamp;
+}
+
+void NGC_HS1::Peer::QueryIndex::remove(const Message& msg) {
+	for (const auto& word : _hs1_split_words(msg.text.data(), msg.text.size())) {
+		auto w_it = words.find(word);
+		if (w_it != words.end()) {
+			w_it->second.erase(msg.msg_id);
+			if (w_it->second.empty()) {
+				words.erase(w_it);
+			}
+		}
+	}
+	for (auto [t_it, t_end] = by_time.equal_range(msg.timestamp); t_it != t_end; t_it++) {
+		if (t_it->second == msg.msg_id) {
+			by_time.erase(t_it);
+			break;
+		}
+	}
+	timestamps.erase(msg.msg_id);
+}
+
+void NGC_HS1::Peer::store(Message&& msg, bool update_index) {
+	const uint32_t msg_id = msg.msg_id;
+	order.push_back(msg_id);
+
+	// overwrites
+	const bool overwrite = dict.count(msg_id);
+	auto& new_msg = dict[msg_id];
+
+	if (overwrite) {
+		digest.toggle(msg_id, Digest::message_hash(new_msg));
+	}
+	digest.toggle(msg_id, Digest::message_hash(msg));
+
+	if (update_index && overwrite) {
+		// remove the old version from the index
+		index.remove(new_msg);
+	}
+
+	new_msg = std::move(msg);
+
+	if (update_index) {
+		index.add(new_msg);
+	}
+
+	if (heard_of.count(msg_id)) {
+		// we got history before we got the message
+		heard_of.erase(msg_id);
+	}
+}
+
+bool NGC_HS1::Peer::has(uint32_t msg_id) const {
+	if (loaded) {
+		return dict.count(msg_id);
+	}
+
+	return std::binary_search(evicted_ids.cbegin(), evicted_ids.cend(), msg_id);
+}
+
+std::vector<uint32_t> NGC_HS1::Peer::last_ids(size_t count) const {
+	std::vector<uint32_t> ids;
+	if (loaded) {
+		for (auto rit = order.crbegin(); ids.size() < count && rit != order.crend(); rit++) {
+			ids.push_back(*rit);
+		}
+	} else {
+		for (auto rit = evicted_last_ids.crbegin(); ids.size() < count && rit != evicted_last_ids.crend(); rit++) {
+			ids.push_back(*rit);
+		}
+	}
+	return ids;
+}
+
+void NGC_HS1::Peer::load(bool update_index) {
+	time_since_access = 0.f;
+
+	if (loaded) {
+		return;
+	}
+
+	loaded = true;
+	evicted_ids.clear();
+	evicted_ids.shrink_to_fit();
+	evicted_offsets.clear();
+	evicted_offsets.shrink_to_fit();
+	evicted_last_ids.clear();
+	evicted_last_ids.shrink_to_fit();
+	digest = {}; // gets rebuilt by store()
+	digest_built = true;
+
+	// a kept index already has all of it
+	const bool build_index = update_index && !index_built;
+	if (update_index) {
+		index_built = true;
+	}
+
+	_hs1_storage_read(
+		storage_file,
+		[](uint32_t) { return true; },
+		[this, build_index](Message&& msg, uint64_t) { store(std::move(msg), build_index); }
+	);
+
+	stored_count = order.size();
+}
+
+const NGC_HS1::Digest& NGC_HS1::Peer::get_digest(void) {
+	if (digest_built) {
+		return digest;
+	}
+	digest_built = true;
+
+	// the texts are needed, but only one at a time
+	std::unordered_map<uint32_t, Digest::Hash> msg_hashes;
+	_hs1_storage_read(
+		storage_file,
+		[](uint32_t) { return true; },
+		[&msg_hashes](Message&& msg, uint64_t) { msg_hashes[msg.msg_id] = Digest::message_hash(msg); } // last one wins
+	);
+
+	for (const auto& [msg_id, msg_hash] : msg_hashes) {
+		digest.toggle(msg_id, msg_hash);
+	}
+
+	return digest;
+}
+
+const NGC_HS1::Peer::QueryIndex& NGC_HS1::Peer::get_index(void) {
+	if (index_built) {
+		return index;
+	}
+	index_built = true;
+
+	// only the latest record of each msg_id counts
+	_hs1_storage_read(
+		storage_file,
+		[](uint32_t) { return true; },
+		[this](Message&& msg, uint64_t offset) {
+			const auto it = std::lower_bound(evicted_ids.cbegin(), evicted_ids.cend(), msg.msg_id);
+			if (it != evicted_ids.cend() && *it == msg.msg_id && evicted_offsets.at(it - evicted_ids.cbegin()) == offset) {
+				index.add(msg);
+			}
+		}
+	);
+
+	return index;
+}
+
+void NGC_HS1::Peer::flush(bool sync) {
+	if (storage_file.empty() || !loaded || stored_count == order.size()) {
+		return;
+	}
+
+	std::error_code err;
+	std::filesystem::create_directories(std::filesystem::path{storage_file}.parent_path(), err);
+
+	FILE* file = fopen(storage_file.c_str(), "ab");
+	if (file == nullptr) {
+		fprintf(stderr, "HS: error, failed to open %s\n", storage_file.c_str());
+		return;
+	}
+
+	// overwritten messages are written with their latest content, replaying gives the same result
+	std::vector<uint8_t> buffer;
+	for (auto it = std::next(order.cbegin(), stored_count); it != order.cend(); it++) {
+		_hs1_storage_serialize(buffer, dict.at(*it));
+	}
+
+	if (fwrite(buffer.data(), buffer.size(), 1, file) != 1 || (sync && !_hs1_storage_sync(file))) {
+		fprintf(stderr, "HS: error, failed to write to %s\n", storage_file.c_str());
+	} else {
+		stored_count = order.size();
+	}
+
+	fclose(file);
+}
+
+void NGC_HS1::Peer::evict(bool sync) {
+	if (storage_file.empty() || !loaded) {
+		return;
+	}
+
+	flush(sync);
+	if (stored_count != order.size()) {
+		// write failed, keep it
+		return;
+	}
+
+	dict.clear();
+	order.clear();
+	stored_count = 0;
+	loaded = false;
+
+	// only the headers, a lot less than the load before it
+	read_evicted();
+}
+
+void NGC_HS1::Peer::read_evicted(void) {
+	evicted_ids.clear();
+	evicted_offsets.clear();
+	evicted_last_ids.clear();
+
+	std::vector<std::pair<uint32_t, uint64_t>> records;
+	_hs1_storage_read(
+		storage_file,
+		[](uint32_t) { return false; },
+		[this, &records](Message&& msg, uint64_t offset) {
+			records.emplace_back(msg.msg_id, offset);
+
+			// file order is order
+			if (evicted_last_ids.size() == evicted_last_ids_max) {
+				evicted_last_ids.erase(evicted_last_ids.begin());
+			}
+			evicted_last_ids.push_back(msg.msg_id);
+		}
+	);
+
+	// overwritten messages are in the file more than once, the last record wins
+	std::stable_sort(records.begin(), records.end(), [](const auto& lhs, const auto& rhs) { return lhs.first < rhs.first; });
+	evicted_ids.reserve(records.size());
+	evicted_offsets.reserve(records.size());
+	for (const auto& [msg_id, offset] : records) {
+		if (!evicted_ids.empty() && evicted_ids.back() == msg_id) {
+			evicted_offsets.back() = offset;
+		} else {
+			evicted_ids.push_back(msg_id);
+			evicted_offsets.push_back(offset);
+		}
+	}
+}
+
+bool NGC_HS1::PeerSet::insert(uint16_t index) {
+	if (index < 64) {
+		const uint64_t bit = uint64_t(1) << index;
+		const bool is_new = !(bits & bit);
+		bits |= bit;
+		return is_new;
+	}
+
+	if (std::find(overflow.cbegin(), overflow.cend(), index) != overflow.cend()) {
+		return false;
+	}
+	overflow.push_back(index);
+	return true;
+}
+
+void NGC_HS1::PeerSet::erase(uint16_t index) {
+	if (index < 64) {
+		bits &= ~(uint64_t(1) << index);
+		return;
+	}
+
+	auto it = std::find(overflow.begin(), overflow.end(), index);
+	if (it != overflow.end()) {
+		*it = overflow.back();
+		overflow.pop_back();
+	}
+}
+
+bool NGC_HS1::PeerSet::empty(void) const {
+	return bits == 0 && overflow.empty();
+}
+
+size_t NGC_HS1::PeerSet::size(void) const {
+	size_t count = overflow.size();
+	for (uint64_t rest = bits; rest != 0; rest &= rest - 1) {
+		count++;
+	}
+	return count;
+}
+
+std::optional<uint16_t> NGC_HS1::PeerSet::nth(size_t n) const {
+	for (uint16_t i = 0; i < 64 && bits >> i != 0; i++) {
+		if ((bits & (uint64_t(1) << i)) && n-- == 0) {
+			return i;
+		}
+	}
+
+	if (n < overflow.size()) {
+		return overflow[n];
+	}
+
+	return std::nullopt;
+}
+
+bool NGC_HS1::Peer::hear(uint32_t msg_id, uint16_t peer_index, uint64_t priority, float now) {
+	if (has(msg_id)) {
+		// we know
+		return false;
+	}
+
+	auto [it, first_time] = heard_of.try_emplace(msg_id);
+	if (first_time) {
+		it->second.priority = priority;
+	}
+	it->second.last_heard = now;
+
+	// returns false if we heard it from that peer before
+	return it->second.sources.insert(peer_index);
+}
+
+NGC_HS1::Peer& NGC_HS1::Group::peer(const NGC_EXT::PeerKey& peer_key) {
+	auto [it, is_new] = peers.try_emplace(peer_key);
+	if (is_new && !storage_dir.empty()) {
+		it->second.storage_file = storage_dir + "/" + _hs1_hex(peer_key.data.data(), peer_key.size()) + ".hs1";
+	}
+	return it->second;
+}
+
+uint16_t NGC_HS1::Group::peer_index(uint32_t peer_number) {
+	auto it = peer_number_to_index.find(peer_number);
+	if (it != peer_number_to_index.end()) {
+		return it->second;
+	}
+
+	// reuse a freed index, keeps them small
+	uint16_t index = 0;
+	while (index < index_to_peer_number.size() && index_to_peer_number[index].has_value()) {
+		index++;
+	}
+	if (index == index_to_peer_number.size()) {
+		index_to_peer_number.emplace_back();
+	}
+
+	index_to_peer_number[index] = peer_number;
+	peer_number_to_index[peer_number] = index;
+
+	return index;
+}
+
+void NGC_HS1::Group::release_peer_index(uint32_t peer_number) {
+	auto it = peer_number_to_index.find(peer_number);
+	if (it == peer_number_to_index.end()) {
+		return;
+	}
+	const uint16_t index = it->second;
+
+	for (auto& [peer_key, peer] : peers) {
+		for (auto h_it = peer.heard_of.begin(); h_it != peer.heard_of.end();) {
+			h_it->second.sources.erase(index);
+			if (h_it->second.sources.empty()) {
+				// no one left to fetch it from
+				h_it = peer.heard_of.erase(h_it);
+			} else {
+				h_it++;
+			}
+		}
+	}
 
-void NGC_HS1::Peer::append(uint32_t msg_id, Tox_Message_Type type, const std::string& text) {
-	order.push_back(msg_id);
+	index_to_peer_number[index].reset();
+	peer_number_to_index.erase(it);
+}
 
-	// overwrites
-	auto& new_msg = dict[msg_id];
-	new_msg.msg_id = msg_id;
-	new_msg.type = type;
-	new_msg.text = text;
+// use this over history[], sets up storage for new groups
+static NGC_HS1::Group& _get_group(NGC_HS1* ngc_hs1_ctx, const NGC_EXT::GroupKey& g_id) {
+	auto [it, is_new] = ngc_hs1_ctx->history.try_emplace(g_id);
+	auto& group = it->second;
+	group.time_since_access = 0.f;
 
-	if (heard_of.count(msg_id)) {
-		// we got history before we got the message
-		heard_of.erase(msg_id);
+	if (!is_new || ngc_hs1_ctx->storage_path.empty()) {
+		return group;
 	}
 
-	fprintf(stderr, "HS: ######## last msgs ########\n");
-	auto rit = order.crbegin();
-	for (size_t i = 0; i < 10 && rit != order.crend(); i++, rit++) {
-		fprintf(stderr, "  %08X - %s\n", *rit, dict.at(*rit).text.c_str());
+	group.storage_dir = ngc_hs1_ctx->storage_path + "/" + _hs1_hex(g_id.data.data(), g_id.size());
+
+	// peers we have messages of, only the msg_ids get read until they are accessed
+	std::error_code err;
+	for (auto dir_it = std::filesystem::directory_iterator(group.storage_dir, err); !err && dir_it != std::filesystem::directory_iterator(); dir_it.increment(err)) {
+		const auto& path = dir_it->path();
+		NGC_EXT::PeerKey p_key;
+		if (path.extension() != ".hs1" || !_hs1_unhex(path.stem().string(), p_key.data.data(), p_key.size())) {
+			continue;
+		}
+
+		auto& peer = group.peer(p_key);
+		peer.loaded = false;
+
+		peer.digest_built = false; // needs the texts
+		peer.index_built = false; // same
+
+		peer.read_evicted();
 	}
+
+	return group;
 }
 
-bool NGC_HS1::Peer::hear(uint32_t msg_id, uint32_t peer_number) {
-	if (dict.count(msg_id)) {
-		// we know
-		return false;
+// the log can start over once everything in it is in the peer files
+static constexpr size_t _hs1_wal_checkpoint_size {16*1024*1024};
+
+static std::string _wal_path(const NGC_HS1* ngc_hs1_ctx) {
+	return ngc_hs1_ctx->storage_path + "/wal.hs1";
+}
+
+// one write (and sync) for everything recorded since the last commit
+static void _wal_commit(NGC_HS1* ngc_hs1_ctx) {
+	ngc_hs1_ctx->wal_last_commit = ngc_hs1_ctx->time;
+
+	if (ngc_hs1_ctx->wal_file == nullptr || ngc_hs1_ctx->wal_buffer.empty()) {
+		return;
+	}
+
+	if (
+		fwrite(ngc_hs1_ctx->wal_buffer.data(), ngc_hs1_ctx->wal_buffer.size(), 1, ngc_hs1_ctx->wal_file) != 1 ||
+		(ngc_hs1_ctx->options.durability >= 3 ? !_hs1_storage_sync(ngc_hs1_ctx->wal_file) : fflush(ngc_hs1_ctx->wal_file) != 0)
+	) {
+		fprintf(stderr, "HS: error, failed to commit %zu messages to the write ahead log\n", ngc_hs1_ctx->wal_buffer_count);
+	}
+
+	ngc_hs1_ctx->wal_size += ngc_hs1_ctx->wal_buffer.size();
+	ngc_hs1_ctx->wal_buffer.clear();
+	ngc_hs1_ctx->wal_buffer_count = 0;
+}
+
+// returns false if not everything could be written, the log is kept then
+static bool _wal_checkpoint(NGC_HS1* ngc_hs1_ctx) {
+	_wal_commit(ngc_hs1_ctx);
+
+	bool all_stored = true;
+	for (auto& [g_id, group] : ngc_hs1_ctx->history) {
+		for (auto& [p_key, peer] : group.peers) {
+			peer.flush(ngc_hs1_ctx->options.durability >= 3);
+			if (!peer.storage_file.empty() && peer.loaded && peer.stored_count != peer.order.size()) {
+				all_stored = false;
+			}
+		}
 	}
 
-	if (heard_of.count(msg_id) && heard_of.at(msg_id).count(peer_number)) {
-		// we heard it from that peer before
+	if (!all_stored) {
+		fprintf(stderr, "HS: error, could not write all peers, keeping the write ahead log\n");
 		return false;
 	}
 
-	heard_of[msg_id].emplace(peer_number);
+	if (ngc_hs1_ctx->wal_file != nullptr) {
+		ngc_hs1_ctx->wal_file = freopen(_wal_path(ngc_hs1_ctx).c_str(), "wb", ngc_hs1_ctx->wal_file);
+		if (ngc_hs1_ctx->wal_file == nullptr) {
+			fprintf(stderr, "HS: error, failed to reopen the write ahead log\n");
+		}
+	}
+	ngc_hs1_ctx->wal_size = 0;
 
 	return true;
 }
 
-void _handle_HS1_ft_recv_request(
-	Tox *tox,
-	uint32_t group_number,
-	uint32_t peer_number,
-	const uint8_t* file_id, size_t file_id_size,
-	void* user_data
-);
+// messages of a previous run that might not have made it into the peer files
+static void _wal_replay(NGC_HS1* ngc_hs1_ctx) {
+	FILE* file = fopen(_wal_path(ngc_hs1_ctx).c_str(), "rb");
+	if (file == nullptr) {
+		return;
+	}
 
-bool _handle_HS1_ft_recv_init(
-	Tox *tox,
-	uint32_t group_number,
-	uint32_t peer_number,
-	const uint8_t* file_id, size_t file_id_size,
-	const uint8_t transfer_id,
-	const size_t file_size,
-	void* user_data
-);
+	size_t replayed_count = 0;
+	while (true) {
+		NGC_EXT::GroupKey g_id;
+		NGC_EXT::PeerKey p_key;
+		NGC_HS1::Message msg;
+
+		if (
+			fread(g_id.data.data(), g_id.size(), 1, file) != 1 ||
+			fread(p_key.data.data(), p_key.size(), 1, file) != 1 ||
+			!_hs1_storage_read_record(file, [](uint32_t) { return true; }, msg)
+		) {
+			break;
+		}
 
-void _handle_HS1_ft_recv_data(
-	Tox *tox,
-	uint32_t group_number,
-	uint32_t peer_number,
-	uint8_t transfer_id,
-	size_t data_offset,
-	const uint8_t* data, size_t data_size,
-	void* user_data
-);
+		auto& peer = _get_group(ngc_hs1_ctx, g_id).peer(p_key);
+		peer.load(ngc_hs1_ctx->options.query_index);
 
-void _handle_HS1_ft_send_data(
-	Tox *tox,
+		auto it = peer.dict.find(msg.msg_id);
+		if (it != peer.dict.end() && it->second.type == msg.type && it->second.text == msg.text) {
+			continue; // made it into the peer file
+		}
 
-	uint32_t group_number,
-	uint32_t peer_number,
-	uint8_t transfer_id,
+		peer.store(std::move(msg), ngc_hs1_ctx->options.query_index);
+		replayed_count++;
+	}
 
-	size_t data_offset, uint8_t* data, size_t data_size,
-	void* user_data
-);
+	fclose(file);
+
+	fprintf(stderr, "HS: replayed %zu messages from the write ahead log\n", replayed_count);
+}
+
+// stores a recorded or fetched message, and logs it if we have a write ahead log
+static void _store_message(
+	NGC_HS1* ngc_hs1_ctx,
+	const NGC_EXT::GroupKey& g_id,
+	const NGC_EXT::PeerKey& p_key,
+	NGC_HS1::Peer& peer,
+	uint32_t msg_id, Tox_Message_Type type, const std::string& text
+) {
+	peer.append(msg_id, type, text, ngc_hs1_ctx->options.query_index);
+
+	if (ngc_hs1_ctx->wal_file == nullptr) {
+		return;
+	}
+
+	auto& wal_buffer = ngc_hs1_ctx->wal_buffer;
+	wal_buffer.insert(wal_buffer.end(), g_id.data.cbegin(), g_id.data.cend());
+	wal_buffer.insert(wal_buffer.end(), p_key.data.cbegin(), p_key.data.cend());
+	_hs1_storage_serialize(wal_buffer, peer.dict.at(msg_id));
+
+	if (++ngc_hs1_ctx->wal_buffer_count >= ngc_hs1_ctx->options.wal_commit_count) {
+		_wal_commit(ngc_hs1_ctx);
+	}
+}
+
+bool NGC_HS1::Group::FetchQueueEntry::operator<(const FetchQueueEntry& rhs) const {
+	// best first
+	if (boosted != rhs.boosted) {
+		return boosted;
+	}
+
+	if (priority != rhs.priority) {
+		return priority > rhs.priority;
+	}
+
+	if (!(msg_peer == rhs.msg_peer)) {
+		return msg_peer < rhs.msg_peer;
+	}
+
+	return msg_id < rhs.msg_id;
+}
+
+void NGC_HS1::Group::queue_fetch(const NGC_EXT::PeerKey& msg_peer, uint32_t msg_id, uint64_t priority) {
+	fetch_queue.emplace(FetchQueueEntry{
+		boosted_peers.count(msg_peer) != 0,
+		priority,
+		msg_peer,
+		msg_id
+	});
+}
+
+void NGC_HS1::Group::fail_fetch(const std::pair<NGC_EXT::PeerKey, uint32_t>& key) {
+	auto it = fetches.find(key);
+	if (it == fetches.end()) {
+		return;
+	}
+
+	if (it->second.state == Fetch::State::TRANSFERRING) {
+		transfers.erase(std::make_pair(it->second.peer_number, it->second.transfer_id));
+	}
+	auto recv_buffer = std::move(it->second.recv_buffer);
+	fetches.erase(it);
+
+	// back into the queue, the next try asks the next source
+	auto peer_it = peers.find(key.first);
+	if (peer_it != peers.end()) {
+		auto heard_it = peer_it->second.heard_of.find(key.second);
+		if (heard_it != peer_it->second.heard_of.end()) {
+			// keep what we got, the next try resumes there
+			heard_it->second.partial = std::move(recv_buffer);
+			queue_fetch(key.first, key.second, heard_it->second.priority);
+		}
+	}
+}
+
+void NGC_HS1::Workers::start(size_t count) {
+	for (size_t i = 0; i < count; i++) {
+		threads.emplace_back([this, shard_i = i+1]() {
+			uint64_t seen_generation = 0;
+			while (true) {
+				std::unique_lock lock(mutex);
+				cv_start.wait(lock, [&]() { return quit || generation != seen_generation; });
+				if (quit) {
+					return;
+				}
+				seen_generation = generation;
+
+				lock.unlock();
+				job(shard_i);
+				lock.lock();
+
+				if (--running == 0) {
+					cv_done.notify_one();
+				}
+			}
+		});
+	}
+}
+
+void NGC_HS1::Workers::run(const std::function<void(size_t)>& fn) {
+	{
+		std::lock_guard lock(mutex);
+		job = fn;
+		running = threads.size();
+		generation++;
+	}
+	cv_start.notify_all();
+
+	// shard 0 on this thread
+	fn(0);
+
+	std::unique_lock lock(mutex);
+	cv_done.wait(lock, [this]() { return running == 0; });
+}
+
+void NGC_HS1::Workers::stop(void) {
+	{
+		std::lock_guard lock(mutex);
+		quit = true;
+	}
+	cv_start.notify_all();
+
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	threads.clear();
+}
+
+// the options added after ft_activity_timeout, callers that dont know them leave them 0
+static void _hs1_options_defaults(NGC_HS1_options& options) {
+	if (options.max_requests_per_iterate == 0) {
+		options.max_requests_per_iterate = 8;
+	}
+	if (options.max_fetches_per_group == 0) {
+		options.max_fetches_per_group = 4;
+	}
+	if (options.heard_of_max_age == 0.f) {
+		options.heard_of_max_age = 300.f;
+	}
+	if (options.evict_after == 0.f) {
+		options.evict_after = 300.f;
+	}
+	if (options.durability == 0) {
+		options.durability = 2;
+	}
+	if (options.wal_commit_interval == 0.f) {
+		options.wal_commit_interval = 0.05f;
+	}
+	if (options.wal_commit_count == 0) {
+		options.wal_commit_count = 1000;
+	}
+	if (options.push_behind_window == 0.f) {
+		options.push_behind_window = 120.f;
+	}
+	if (options.max_message_size == 0) {
+		options.max_message_size = 16*1024*1024;
+	}
+}
 
 NGC_HS1* NGC_HS1_new(const struct NGC_HS1_options* options) {
 	auto* ngc_hs1_ctx = new NGC_HS1;
 	ngc_hs1_ctx->options = *options;
+	_hs1_options_defaults(ngc_hs1_ctx->options);
+	if (options->storage_path != nullptr) {
+		ngc_hs1_ctx->storage_path = options->storage_path;
+	}
+	ngc_hs1_ctx->options.storage_path = nullptr; // dont keep the callers pointer
+
+	if (options->trace_path != nullptr) {
+		ngc_hs1_ctx->trace.file = fopen(options->trace_path, "wb");
+		if (ngc_hs1_ctx->trace.file == nullptr) {
+			fprintf(stderr, "HS: error, failed to open trace %s\n", options->trace_path);
+		} else {
+			const uint8_t header[] {'H', 'S', '1', 'T', 1};
+			ngc_hs1_ctx->trace.buffer.assign(std::begin(header), std::end(header));
+		}
+	}
+	ngc_hs1_ctx->options.trace_path = nullptr;
+
+	if (!ngc_hs1_ctx->storage_path.empty()) {
+		std::error_code err;
+		std::filesystem::create_directories(ngc_hs1_ctx->storage_path, err);
+
+		// writes the replayed messages to the peer files
+		_wal_replay(ngc_hs1_ctx);
+		const bool all_stored = _wal_checkpoint(ngc_hs1_ctx);
+
+		if (ngc_hs1_ctx->options.durability >= 2) {
+			ngc_hs1_ctx->wal_file = fopen(_wal_path(ngc_hs1_ctx).c_str(), all_stored ? "wb" : "ab");
+			if (ngc_hs1_ctx->wal_file == nullptr) {
+				fprintf(stderr, "HS: error, failed to open the write ahead log\n");
+			}
+		} else if (all_stored) {
+			std::filesystem::remove(_wal_path(ngc_hs1_ctx), err);
+		}
+	}
+	ngc_hs1_ctx->last_iterate = std::chrono::steady_clock::now();
+
+	ngc_hs1_ctx->shards.resize(std::max<size_t>(options->worker_threads, 1));
+	ngc_hs1_ctx->workers.start(ngc_hs1_ctx->shards.size() - 1);
+
 	return ngc_hs1_ctx;
 }
 
@@ -95,8 +1250,13 @@ bool NGC_HS1_register_ext(NGC_HS1* ngc_hs1_ctx, NGC_EXT_CTX* ngc_ext_ctx) {
 	ngc_ext_ctx->callbacks[NGC_EXT::HS1_REQUEST_LAST_IDS] = _handle_HS1_REQUEST_LAST_IDS;
 	ngc_ext_ctx->callbacks[NGC_EXT::HS1_RESPONSE_LAST_IDS] = _handle_HS1_RESPONSE_LAST_IDS;
 
+	ngc_ext_ctx->callbacks[NGC_HS1_EXT::HS1_REQUEST_DIGEST] = _handle_HS1_REQUEST_DIGEST;
+	ngc_ext_ctx->callbacks[NGC_HS1_EXT::HS1_RESPONSE_DIGEST] = _handle_HS1_RESPONSE_DIGEST;
+
 	ngc_ext_ctx->user_data[NGC_EXT::HS1_REQUEST_LAST_IDS] = ngc_hs1_ctx;
 	ngc_ext_ctx->user_data[NGC_EXT::HS1_RESPONSE_LAST_IDS] = ngc_hs1_ctx;
+	ngc_ext_ctx->user_data[NGC_HS1_EXT::HS1_REQUEST_DIGEST] = ngc_hs1_ctx;
+	ngc_ext_ctx->user_data[NGC_HS1_EXT::HS1_RESPONSE_DIGEST] = ngc_hs1_ctx;
 
 	return true;
 }
@@ -113,164 +1273,534 @@ bool NGC_HS1_register_ft1(NGC_HS1* ngc_hs1_ctx, NGC_FT1* ngc_ft1_ctx) {
 }
 
 void NGC_HS1_kill(NGC_HS1* ngc_hs1_ctx) {
+	ngc_hs1_ctx->workers.stop();
+
+	// everything into the peer files
+	_wal_checkpoint(ngc_hs1_ctx);
+	if (ngc_hs1_ctx->wal_file != nullptr) {
+		fclose(ngc_hs1_ctx->wal_file);
+	}
+
+	_trace_flush(ngc_hs1_ctx);
+	if (ngc_hs1_ctx->trace.file != nullptr) {
+		fclose(ngc_hs1_ctx->trace.file);
+	}
+
 	delete ngc_hs1_ctx;
 }
 
-static void _iterate_group(Tox *tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, float time_delta) {
-	NGC_EXT::GroupKey g_id{};
-	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+// request the best heard of message from the queue, returns false if there is nothing to request
+static bool _start_next_fetch(NGC_HS1* ngc_hs1_ctx, NGC_HS1::Outbox& outbox, uint32_t group_number, NGC_HS1::Group& group) {
+	for (auto it = group.fetch_queue.begin(); it != group.fetch_queue.end(); it = group.fetch_queue.erase(it)) {
+		const auto& [boosted, priority, msg_peer, msg_id] = *it;
+
+		auto peer_it = group.peers.find(msg_peer);
+		if (peer_it == group.peers.end()) {
+			continue;
+		}
+		auto& peer = peer_it->second;
+
+		if (group.fetches.count(std::make_pair(msg_peer, msg_id))) {
+			// allready fetching, requeued on failure
+			continue;
+		}
+
+		auto heard_it = peer.heard_of.find(msg_id);
+		if (heard_it == peer.heard_of.end()) {
+			// got it in the meantime
+			continue;
+		}
+
+		// round robin over who has it, so a source that never answers does not block the others
+		const auto& sources = heard_it->second.sources;
+		const auto remote_peer_index = sources.nth(heard_it->second.fetch_attempts % std::max<size_t>(sources.size(), 1));
+		if (!remote_peer_index.has_value() || !group.index_to_peer_number.at(remote_peer_index.value()).has_value()) {
+			fprintf(stderr, "HS: !!! msg_id we heard of, but no remote peer !!!\n");
+			continue;
+		}
+
+		const uint32_t remote_peer_number = group.index_to_peer_number.at(remote_peer_index.value()).value();
+
+		auto& fetch = group.fetches[std::make_pair(msg_peer, msg_id)];
+		fetch.peer_number = remote_peer_number;
+
+		// continue where the last try stopped, if that peer understands it
+		const auto caps_it = group.capabilities.find(remote_peer_number);
+		if (caps_it != group.capabilities.end() && (caps_it->second & NGC_HS1_EXT::HS1_CAP_RESUME)) {
+			fetch.recv_buffer = std::move(heard_it->second.partial);
+		}
+		heard_it->second.partial.clear();
+		fetch.resume_offset = fetch.recv_buffer.size();
+
+		// send request
+		outbox.ft_requests.push_back({group_number, remote_peer_number, _hs1_make_file_id(msg_peer, msg_id, fetch.recv_buffer.size())});
+
+		fetch.retry = heard_it->second.fetch_attempts++ > 0;
+		fetch.requested_at = ngc_hs1_ctx->time;
+		group.link(remote_peer_number, ngc_hs1_ctx->options.ft_activity_timeout);
+
+		group.fetch_queue.erase(it);
+		return true;
+	}
+
+	return false;
+}
+
+// start fetches until the group is at max_fetches_per_group or out of budget
+static void _fill_fetches(NGC_HS1* ngc_hs1_ctx, NGC_HS1::Outbox& outbox, uint32_t group_number, NGC_HS1::Group& group, size_t& request_budget) {
+	if (ngc_hs1_ctx->options.delivery_queue_size > 0 && ngc_hs1_ctx->delivery_queue.size() >= ngc_hs1_ctx->options.delivery_queue_size) {
+		// backpressure, wait for the consumer
+		return;
+	}
+
+	while (
+		request_budget > 0 &&
+		group.fetches.size() < ngc_hs1_ctx->options.max_fetches_per_group &&
+		_start_next_fetch(ngc_hs1_ctx, outbox, group_number, group)
+	) {
+		request_budget--;
+	}
+}
+
+// chat ids are random enough to just use some bytes
+static size_t _shard_of(const NGC_EXT::GroupKey& g_id, size_t shard_count) {
+	uint32_t value = 0;
+	std::copy(g_id.data.cbegin(), g_id.data.cbegin()+sizeof(value), reinterpret_cast<uint8_t*>(&value));
+	return value % shard_count;
+}
+
+static void _flush_outbox(Tox *tox, NGC_HS1* ngc_hs1_ctx, NGC_HS1::Outbox& outbox) {
+	for (const auto& pkg : outbox.custom_packets) {
+		_hs1_group_send_custom_packet(tox, ngc_hs1_ctx, pkg.group_number, pkg.peer_number, pkg.data);
+	}
+	outbox.custom_packets.clear();
+
+	for (const auto& request : outbox.ft_requests) {
+		_hs1_ft_send_request(tox, ngc_hs1_ctx, request.group_number, request.peer_number, request.file_id);
+	}
+	outbox.ft_requests.clear();
+}
+
+static std::vector<uint8_t> _make_digest_request(const NGC_EXT::PeerKey& peer_key, uint8_t level, uint16_t prefix, const NGC_HS1::Digest::Hash& hash) {
+	// - 1 byte packet id
+	// - peer_key bytes
+	// - 1 byte level
+	// - 2 bytes prefix
+	// - 32 bytes node hash
+	std::vector<uint8_t> pkg;
+	pkg.reserve(1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1+sizeof(prefix)+hash.size());
+
+	pkg.push_back(NGC_HS1_EXT::HS1_REQUEST_DIGEST);
+	pkg.insert(pkg.end(), peer_key.data.cbegin(), peer_key.data.cend());
+	pkg.push_back(level);
+	// HACK: little endian
+	pkg.insert(pkg.end(), reinterpret_cast<const uint8_t*>(&prefix), reinterpret_cast<const uint8_t*>(&prefix)+sizeof(prefix));
+	pkg.insert(pkg.end(), hash.cbegin(), hash.cend());
+
+	return pkg;
+}
+
+static void _mark_behind(NGC_HS1* ngc_hs1_ctx, NGC_HS1::Group& group, uint32_t peer_number) {
+	if (!ngc_hs1_ctx->options.push_new_ids) {
+		return;
+	}
+
+	group.behind[peer_number] = group.time + ngc_hs1_ctx->options.push_behind_window;
+}
+
+// sends the queued new msg_ids to the peers that are behind, in HS1_RESPONSE_LAST_IDS packets
+static void _push_new_ids(NGC_HS1::Outbox& outbox, uint32_t group_number, NGC_HS1::Group& group) {
+	for (auto it = group.behind.begin(); it != group.behind.end();) {
+		if (it->second <= group.time) {
+			it = group.behind.erase(it);
+		} else {
+			it++;
+		}
+	}
+
+	if (group.behind.empty()) {
+		group.push_queue.clear();
+		return;
+	}
+
+	// count is one byte
+	constexpr size_t max_ids = std::min<size_t>(
+		(TOX_MAX_CUSTOM_PACKET_SIZE-(1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1))/sizeof(uint32_t),
+		UINT8_MAX
+	);
+
+	for (const auto& [peer_key, msg_ids] : group.push_queue) {
+		// the author has them
+		const auto author_it = group.peers.find(peer_key);
+		const std::optional<uint32_t> author = author_it != group.peers.end() ? author_it->second.id : std::nullopt;
+
+		// newest first, same as a response to a request
+		for (auto rit = msg_ids.crbegin(); rit != msg_ids.crend();) {
+			const size_t count = std::min<size_t>(max_ids, std::distance(rit, msg_ids.crend()));
+
+			std::vector<uint8_t> pkg;
+			pkg.reserve(1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1+count*sizeof(uint32_t));
+			pkg.push_back(NGC_EXT::HS1_RESPONSE_LAST_IDS);
+			pkg.insert(pkg.end(), peer_key.data.cbegin(), peer_key.data.cend());
+			pkg.push_back(count);
+			for (size_t i = 0; i < count; i++, rit++) {
+				// HACK: little endian
+				const uint8_t* tmp_ptr = reinterpret_cast<const uint8_t*>(&*rit);
+				pkg.insert(pkg.end(), tmp_ptr, tmp_ptr+sizeof(uint32_t));
+			}
+
+			for (const auto& [peer_number, until] : group.behind) {
+				if (author != peer_number) {
+					outbox.custom_packets.push_back({group_number, pkg, peer_number});
+				}
+			}
+		}
+	}
+	group.push_queue.clear();
+}
+
+// can run on a shard worker, no tox calls in here
+static void _iterate_group(NGC_HS1* ngc_hs1_ctx, NGC_HS1::Outbox& outbox, uint32_t group_number, NGC_HS1::Group& group, float time_delta, size_t& request_budget) {
+	group.time += time_delta;
+
+	// forget heard of msg_ids no one advertises anymore
+	group.time_since_heard_of_sweep += time_delta;
+	if (group.time_since_heard_of_sweep >= 10.f) {
+		group.time_since_heard_of_sweep = 0.f;
+		for (auto& [peer_key, peer] : group.peers) {
+			for (auto it = peer.heard_of.begin(); it != peer.heard_of.end();) {
+				if (group.time - it->second.last_heard >= ngc_hs1_ctx->options.heard_of_max_age) {
+					it = peer.heard_of.erase(it);
+				} else {
+					it++;
+				}
+			}
+		}
+	}
+
+	// check if requests or transfers have timed out
+	const float max_timeout = ngc_hs1_ctx->options.ft_activity_timeout;
+	std::vector<std::pair<NGC_EXT::PeerKey, uint32_t>> timed_out;
+	std::set<uint32_t> timed_out_peers;
+	for (auto& [key, fetch] : group.fetches) {
+		fetch.time_since_ft_activity += time_delta;
+
+		const auto& link = group.link(fetch.peer_number, max_timeout);
+		const float timeout = fetch.state == NGC_HS1::Group::Fetch::State::REQUESTED ? link.rto : link.transfer_timeout(max_timeout);
+		if (fetch.time_since_ft_activity >= timeout) {
+			fprintf(stderr, "HS: !!! fetch timed out after %.2fs (%08X)\n", fetch.time_since_ft_activity, key.second);
+			timed_out.push_back(key);
+			timed_out_peers.emplace(fetch.peer_number);
+		}
+	}
+	for (const auto& key : timed_out) {
+		group.fail_fetch(key);
+	}
+	// once per peer, several fetches timing out together are one loss event
+	for (const uint32_t peer_number : timed_out_peers) {
+		group.link(peer_number, max_timeout).backoff(max_timeout);
+	}
+
+	// for each peer
+	for (auto& [peer_key, peer] : group.peers) {
+		//fprintf(stderr, "  p: %X%X%X%X\n", key.data.data()[0], key.data.data()[1], key.data.data()[2], key.data.data()[3]);
+		if (peer.loaded && !peer.storage_file.empty()) {
+			peer.time_since_access += time_delta;
+			if (peer.time_since_access >= ngc_hs1_ctx->options.evict_after) {
+				fprintf(stderr, "HS: evicting peer %X%X%X%X\n", peer_key.data.data()[0], peer_key.data.data()[1], peer_key.data.data()[2], peer_key.data.data()[3]);
+				peer.evict(ngc_hs1_ctx->options.durability >= 3);
+			}
+		}
+
+		peer.time_since_last_request_sent += time_delta;
+		if (peer.time_since_last_request_sent > ngc_hs1_ctx->options.query_interval_per_peer) {
+			peer.time_since_last_request_sent = 0.f;
+
+			//fprintf(stderr, "HS: requesting ids for %X%X%X%X\n", peer_key.data.data()[0], peer_key.data.data()[1], peer_key.data.data()[2], peer_key.data.data()[3]);
+
+			// TODO: other way around?
+			// ask everyone if they have newer stuff for this peer
+
+			// - 1 byte packet id
+			// - peer_key bytes (peer key we want to know ids for)
+			// - 1 byte (uint8_t count ids, atleast 1)
+			// - 1 byte capabilities (NGC_HS1_EXT::Capability, optional)
+			std::vector<uint8_t> pkg(1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1+1);
+			pkg[0] = NGC_EXT::HS1_REQUEST_LAST_IDS;
+			std::copy(peer_key.data.begin(), peer_key.data.end(), pkg.begin()+1);
+			pkg[1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE] = ngc_hs1_ctx->options.last_msg_ids_count; // request last (up to) 5 msg_ids
+			pkg[1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1] = NGC_HS1_EXT::HS1_CAP_RESUME;
+
+			outbox.custom_packets.push_back({group_number, std::move(pkg)});
+
+			if (ngc_hs1_ctx->options.digest_sync) {
+				// only peers with a different root respond
+				outbox.custom_packets.push_back({group_number, _make_digest_request(peer_key, 0, 0, peer.get_digest().root())});
+			}
+		}
+	}
+
+	if (!group.behind.empty() || !group.push_queue.empty()) {
+		_push_new_ids(outbox, group_number, group);
+	}
+
+	// request FT for only heard of message_ids, best first
+	_fill_fetches(ngc_hs1_ctx, outbox, group_number, group, request_budget);
+}
+
+static constexpr float _hs1_trust_cache_ttl {10.f}; // seconds
+
+static uint8_t _hs1_role_trust_level(Tox_Group_Role role) {
+	switch (role) {
+		case TOX_GROUP_ROLE_FOUNDER: return 3;
+		case TOX_GROUP_ROLE_MODERATOR: return 2;
+		case TOX_GROUP_ROLE_USER: return 1;
+		default: return 0; // observer
+	}
+}
+
+// checks the remote peer against options.default_trust_level
+// call before doing any work for a packet/ft from that peer
+static bool _peer_trusted(const Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number) {
+	const uint8_t min_level = ngc_hs1_ctx->options.default_trust_level;
+	if (min_level == 0) {
+		return true; // everyone, no need to look up the role
+	} else if (min_level >= 4) {
+		return false; // no one
+	}
+
+	const double now = ngc_hs1_ctx->time;
+	const uint64_t key = uint64_t(group_number) << 32 | peer_number;
+
+	auto it = ngc_hs1_ctx->trust_cache.find(key);
+	if (it == ngc_hs1_ctx->trust_cache.end() || now - it->second.checked >= _hs1_trust_cache_ttl) {
+		Tox_Group_Role role {TOX_GROUP_ROLE_OBSERVER};
+
+		// unknown peers get the lowest level
+		const uint8_t level = _hs1_group_peer_get_role(tox, ngc_hs1_ctx, group_number, peer_number, role) ? _hs1_role_trust_level(role) : 0;
+
+		it = ngc_hs1_ctx->trust_cache.insert_or_assign(key, NGC_HS1::CachedTrust{level, now}).first;
+	}
+
+	return it->second.level >= min_level;
+}
+
+void NGC_HS1_iterate(Tox *tox, NGC_HS1* ngc_hs1_ctx) {
+	assert(ngc_hs1_ctx);
+
+	const auto now = std::chrono::steady_clock::now();
+	// capped, so a stalled caller does not time everything out at once
+	float time_delta = std::min(std::chrono::duration<float>(now - ngc_hs1_ctx->last_iterate).count(), 1.f);
+	ngc_hs1_ctx->last_iterate = now;
+	if (ngc_hs1_ctx->trace.replaying) {
+		time_delta = ngc_hs1_ctx->trace.replay_time_delta;
+	}
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::ITERATE, time_delta);
+	ngc_hs1_ctx->time += time_delta;
+
+	// group commit
+	if (
+		ngc_hs1_ctx->wal_buffer_count > 0 &&
+		ngc_hs1_ctx->time - ngc_hs1_ctx->wal_last_commit >= ngc_hs1_ctx->options.wal_commit_interval
+	) {
+		_wal_commit(ngc_hs1_ctx);
+	}
+	if (ngc_hs1_ctx->wal_size >= _hs1_wal_checkpoint_size) {
+		_wal_checkpoint(ngc_hs1_ctx);
 	}
 
-	if (ngc_hs1_ctx->history.count(g_id) == 0) {
-		fprintf(stderr, "HS: adding new group: %u %X%X%X%X\n",
-			group_number,
-			g_id.data.data()[0],
-			g_id.data.data()[1],
-			g_id.data.data()[2],
-			g_id.data.data()[3]
-		);
-		ngc_hs1_ctx->history[g_id];
-	} else {
-		auto& group = ngc_hs1_ctx->history[g_id];
-
-		// check if transfers have timed out
-		for (auto it = group.transfers.begin(); it != group.transfers.end();) {
-			it->second.time_since_ft_activity += time_delta;
-			if (it->second.time_since_ft_activity >= ngc_hs1_ctx->options.ft_activity_timeout) {
-				// timed out
-				fprintf(stderr, "HS: !!! ft timed out (%08X)\n", it->first.first);
-				it = group.transfers.erase(it);
+	// drop expired roles of peers we did not hear from again
+	if (ngc_hs1_ctx->time - ngc_hs1_ctx->trust_cache_last_prune >= _hs1_trust_cache_ttl) {
+		ngc_hs1_ctx->trust_cache_last_prune = ngc_hs1_ctx->time;
+		for (auto it = ngc_hs1_ctx->trust_cache.begin(); it != ngc_hs1_ctx->trust_cache.end();) {
+			if (ngc_hs1_ctx->time - it->second.checked >= _hs1_trust_cache_ttl) {
+				it = ngc_hs1_ctx->trust_cache.erase(it);
 			} else {
 				it++;
 			}
 		}
+	}
 
-		// for each peer
-		for (auto& [peer_key, peer] : group.peers) {
-			//fprintf(stderr, "  p: %X%X%X%X\n", key.data.data()[0], key.data.data()[1], key.data.data()[2], key.data.data()[3]);
-			peer.time_since_last_request_sent += time_delta;
-			if (peer.time_since_last_request_sent > ngc_hs1_ctx->options.query_interval_per_peer) {
-				peer.time_since_last_request_sent = 0.f;
-
-				//fprintf(stderr, "HS: requesting ids for %X%X%X%X\n", peer_key.data.data()[0], peer_key.data.data()[1], peer_key.data.data()[2], peer_key.data.data()[3]);
-
-				// TODO: other way around?
-				// ask everyone if they have newer stuff for this peer
-
-				// - 1 byte packet id
-				// - peer_key bytes (peer key we want to know ids for)
-				// - 1 byte (uint8_t count ids, atleast 1)
-				std::array<uint8_t, 1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+1> pkg;
-				pkg[0] = NGC_EXT::HS1_REQUEST_LAST_IDS;
-				std::copy(peer_key.data.begin(), peer_key.data.end(), pkg.begin()+1);
-				pkg[1+TOX_GROUP_PEER_PUBLIC_KEY_SIZE] = ngc_hs1_ctx->options.last_msg_ids_count; // request last (up to) 5 msg_ids
-
-				tox_group_send_custom_packet(tox, group_number, true, pkg.data(), pkg.size(), nullptr);
-			}
-
-			// check if pending msg requests have timed out
-			for (auto it = peer.pending.begin(); it != peer.pending.end();) {
-				it->second.time_since_ft_activity += time_delta;
-				if (it->second.time_since_ft_activity >= ngc_hs1_ctx->options.ft_activity_timeout) {
-					// timed out
-					fprintf(stderr, "HS: !!! pending ft request timed out (%08X)\n", it->first);
-					it = peer.pending.erase(it);
-				} else {
-					it++;
-				}
+	// page out groups no one touched for a while (eg. left or not connected), with all their peers
+	if (!ngc_hs1_ctx->storage_path.empty()) {
+		for (auto it = ngc_hs1_ctx->history.begin(); it != ngc_hs1_ctx->history.end();) {
+			auto& [g_id, group] = *it;
+			group.time_since_access += time_delta;
+			if (
+				group.time_since_access < ngc_hs1_ctx->options.evict_after ||
+				group.boosted || !group.boosted_peers.empty() ||
+				!group.fetches.empty() || !group.sending.empty()
+			) {
+				it++;
+				continue;
 			}
 
-			// request FT for only heard of message_ids
-			size_t request_made_count = 0;
-			for (const auto& [msg_id, remote_peer_numbers] : peer.heard_of) {
-				if (request_made_count >= 2) { // 2 for test
-					// TODO: limit requests per iterate option
-					break;
-				}
+			bool all_evicted = true;
+			for (auto& [peer_key, peer] : group.peers) {
+				peer.evict(ngc_hs1_ctx->options.durability >= 3);
+				all_evicted = all_evicted && !peer.loaded;
+			}
+			if (!all_evicted) {
+				// write failed, try again later
+				group.time_since_access = 0.f;
+				it++;
+				continue;
+			}
 
-				if (peer.pending.count(msg_id)) {
-					continue; // allready requested
-				}
+			fprintf(stderr, "HS: evicting group %X%X%X%X\n", g_id.data.data()[0], g_id.data.data()[1], g_id.data.data()[2], g_id.data.data()[3]);
+			it = ngc_hs1_ctx->history.erase(it);
+		}
+	}
 
-				if (remote_peer_numbers.empty()) {
-					fprintf(stderr, "HS: !!! msg_id we heard of, but no remote peer !!!\n");
-					continue;
-				}
+	auto& shards = ngc_hs1_ctx->shards;
+	for (auto& shard : shards) {
+		shard.groups.clear();
+	}
+
+	// boosted groups are iterated first, on the calling thread, so they get the request budget before any shard
+	std::vector<std::pair<uint32_t, NGC_HS1::Group*>> boosted_groups;
 
-				const uint32_t remote_peer_number = *remote_peer_numbers.begin();
+	for (const uint32_t g_i : _hs1_connected_groups(tox, ngc_hs1_ctx)) {
+		NGC_EXT::GroupKey g_id{};
+		{ // TODO: error
+			_hs1_group_get_chat_id(tox, ngc_hs1_ctx, g_i, g_id);
+		}
 
-				// craft file id
-				std::array<uint8_t, TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t)> file_id{};
-				{
-					std::copy(peer_key.data.cbegin(), peer_key.data.cend(), file_id.begin());
+		const bool new_group = !ngc_hs1_ctx->history.count(g_id);
+		auto& group = _get_group(ngc_hs1_ctx, g_id);
+		if (new_group) {
+			fprintf(stderr, "HS: adding new group: %u %X%X%X%X\n",
+				g_i,
+				g_id.data.data()[0],
+				g_id.data.data()[1],
+				g_id.data.data()[2],
+				g_id.data.data()[3]
+			);
+		} else if (group.boosted) {
+			boosted_groups.emplace_back(g_i, &group);
+		} else {
+			shards.at(_shard_of(g_id, shards.size())).groups.emplace_back(g_i, &group);
+		}
+	}
 
-					// HACK: little endian
-					const uint8_t* tmp_ptr = reinterpret_cast<const uint8_t*>(&msg_id);
-					std::copy(tmp_ptr, tmp_ptr+sizeof(uint32_t), file_id.begin()+TOX_GROUP_PEER_PUBLIC_KEY_SIZE);
-				}
+	size_t request_budget = ngc_hs1_ctx->options.max_requests_per_iterate;
+	NGC_HS1::Outbox boosted_outbox;
+	for (auto& [group_number, group] : boosted_groups) {
+		_iterate_group(ngc_hs1_ctx, boosted_outbox, group_number, *group, time_delta, request_budget);
+	}
 
-				// send request
-				NGC_FT1_send_request_private(
-					tox, ngc_hs1_ctx->ngc_ft1_ctx,
-					group_number, remote_peer_number,
-					NGC_FT1_file_kind::NGC_HS1_MESSAGE_BY_ID,
-					file_id.data(), file_id.size()
-				);
+	// what is left, split exactly, the first shards get the remainder
+	for (size_t shard_i = 0; shard_i < shards.size(); shard_i++) {
+		shards[shard_i].request_budget = request_budget / shards.size() + (shard_i < request_budget % shards.size() ? 1 : 0);
+	}
 
-				peer.pending[msg_id] = {remote_peer_number, 0.f};
+	const auto iterate_shard = [ngc_hs1_ctx, time_delta](size_t shard_i) {
+		auto& shard = ngc_hs1_ctx->shards.at(shard_i);
 
-				request_made_count++;
-			}
+		for (auto& [group_number, group] : shard.groups) {
+			_iterate_group(ngc_hs1_ctx, shard.outbox, group_number, *group, time_delta, shard.request_budget);
 		}
+	};
+
+	if (shards.size() == 1) {
+		iterate_shard(0);
+	} else {
+		ngc_hs1_ctx->workers.run(iterate_shard);
 	}
 
-	assert(ngc_hs1_ctx->history.size() != 0);
-	assert(ngc_hs1_ctx->history.count(g_id));
+	_flush_outbox(tox, ngc_hs1_ctx, boosted_outbox);
+	for (auto& shard : shards) {
+		_flush_outbox(tox, ngc_hs1_ctx, shard.outbox);
+	}
+
+	_trace_flush(ngc_hs1_ctx);
 }
 
-void NGC_HS1_iterate(Tox *tox, NGC_HS1* ngc_hs1_ctx) {
+void NGC_HS1_boost_group(const Tox *tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, bool boost) {
 	assert(ngc_hs1_ctx);
 
-	uint32_t group_count = tox_group_get_number_groups(tox);
-	// this can loop endless if toxcore misbehaves
-	for (uint32_t g_i = 0, g_c_done = 0; g_c_done < group_count; g_i++) {
-		Tox_Err_Group_Is_Connected g_err;
-		if (tox_group_is_connected(tox, g_i, &g_err)) {
-			// valid and connected here
-			// TODO: delta time, or other timers
-			_iterate_group(tox, ngc_hs1_ctx, g_i, 0.02f);
-			g_c_done++;
-		} else if (g_err != TOX_ERR_GROUP_IS_CONNECTED_GROUP_NOT_FOUND) {
-			g_c_done++;
-		} // else do nothing
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::BOOST_GROUP, group_number, uint8_t(boost));
 
-		// safety
-		if (g_i > group_count + 1000) {
-			fprintf(stderr, "HS: WAY PAST GOUPS in iterate\n");
-			break;
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	_get_group(ngc_hs1_ctx, g_id).boosted = boost;
+}
+
+void NGC_HS1_boost_peer(const Tox *tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, const uint8_t* public_key, bool boost) {
+	assert(ngc_hs1_ctx);
+	assert(public_key);
+
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::BOOST_PEER, group_number, uint8_t(boost), _hs1_bytes{public_key, NGC_EXT::PeerKey{}.size()});
+
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	NGC_EXT::PeerKey p_key;
+	std::copy(public_key, public_key+p_key.size(), p_key.data.begin());
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	if (boost) {
+		if (!group.boosted_peers.emplace(p_key).second) {
+			return; // no change
+		}
+	} else if (group.boosted_peers.erase(p_key) == 0) {
+		return; // no change
+	}
+
+	// resort the entries of that peer
+	std::vector<NGC_HS1::Group::FetchQueueEntry> entries;
+	for (auto it = group.fetch_queue.begin(); it != group.fetch_queue.end();) {
+		if (it->msg_peer == p_key) {
+			entries.push_back(*it);
+			it = group.fetch_queue.erase(it);
+		} else {
+			it++;
 		}
 	}
+	for (auto& entry : entries) {
+		entry.boosted = boost;
+		group.fetch_queue.emplace(entry);
+	}
 }
 
 void NGC_HS1_peer_online(Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number, bool online) {
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::PEER_ONLINE, group_number, peer_number, uint8_t(online));
+
+	// new peer or reused peer_number, look the role up again
+	ngc_hs1_ctx->trust_cache.erase(uint64_t(group_number) << 32 | peer_number);
+
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
-	auto& group = ngc_hs1_ctx->history[g_id];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
 
 	if (online) {
 		// get peer id
 		NGC_EXT::PeerKey p_id{};
 		{ // TODO: error
-			tox_group_peer_get_public_key(tox, group_number, peer_number, p_id.data.data(), nullptr);
+			_hs1_group_peer_get_public_key(tox, ngc_hs1_ctx, group_number, peer_number, p_id);
 		}
 
-		auto& peer = group.peers[p_id];
+		auto& peer = group.peer(p_id);
 		peer.id = peer_number;
+
+		group.links.erase(peer_number);
+		group.capabilities.erase(peer_number);
+
+		// joined late, probably missing history
+		if (_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+			_mark_behind(ngc_hs1_ctx, group, peer_number);
+		}
 	} else { // offline
 		// search
 		for (auto& [key, peer] : group.peers) {
@@ -279,6 +1809,38 @@ void NGC_HS1_peer_online(Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number,
 				break;
 			}
 		}
+
+		// the peer_number might get reused by someone else
+		group.release_peer_index(peer_number);
+		group.links.erase(peer_number);
+		group.capabilities.erase(peer_number);
+		group.behind.erase(peer_number);
+
+		// dont wait for the timeouts, retry what we fetched from them with someone else
+		std::vector<std::pair<NGC_EXT::PeerKey, uint32_t>> lost;
+		for (const auto& [key, fetch] : group.fetches) {
+			if (fetch.peer_number == peer_number) {
+				lost.push_back(key);
+			}
+		}
+		for (const auto& key : lost) {
+			group.fail_fetch(key);
+		}
+
+		for (auto it = group.sending.begin(); it != group.sending.end();) {
+			if (it->first.first == peer_number) {
+				it = group.sending.erase(it);
+			} else {
+				it++;
+			}
+		}
+
+		if (!lost.empty()) {
+			size_t request_budget = ngc_hs1_ctx->options.max_fetches_per_group;
+			NGC_HS1::Outbox outbox;
+			_fill_fetches(ngc_hs1_ctx, outbox, group_number, group, request_budget);
+			_flush_outbox(tox, ngc_hs1_ctx, outbox);
+		}
 	}
 }
 
@@ -315,20 +1877,27 @@ void NGC_HS1_record_own_message(
 
 	Tox_Message_Type type, const uint8_t *message, size_t length, uint32_t message_id
 ) {
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::RECORD_OWN_MESSAGE, group_number, uint8_t(type), message_id, _hs1_bytes{message, length});
+
 	fprintf(stderr, "HS: record_own_message %08X\n", message_id);
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
 	// get peer id
 	NGC_EXT::PeerKey p_id{};
 	{ // TODO: error
-		tox_group_self_get_public_key(tox, group_number, p_id.data.data(), nullptr);
+		_hs1_group_self_get_public_key(tox, ngc_hs1_ctx, group_number, p_id);
 	}
 
-	ngc_hs1_ctx->history[g_id].peers[p_id].append(message_id, type, std::string{message, message+length});
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	_store_message(ngc_hs1_ctx, g_id, p_id, group.peer(p_id), message_id, type, std::string{message, message+length});
+
+	if (!group.behind.empty()) {
+		group.push_queue[p_id].push_back(message_id);
+	}
 	assert(ngc_hs1_ctx->history.size() != 0);
 	assert(ngc_hs1_ctx->history.count(g_id));
 }
@@ -339,6 +1908,39 @@ void NGC_HS1_register_callback_group_message(NGC_HS1* ngc_hs1_ctx, NGC_HS1_group
 	ngc_hs1_ctx->cb_group_message = callback;
 }
 
+size_t NGC_HS1_poll_messages(NGC_HS1* ngc_hs1_ctx, struct NGC_HS1_message* messages, size_t max_count) {
+	assert(ngc_hs1_ctx);
+
+	ngc_hs1_ctx->delivery_polled.clear();
+
+	if (messages == nullptr) {
+		return 0;
+	}
+
+	const size_t count = std::min(max_count, ngc_hs1_ctx->delivery_queue.size());
+	// the queue frees up, which changes what gets requested next
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::POLL_MESSAGES, uint64_t(count));
+	std::move(ngc_hs1_ctx->delivery_queue.begin(), ngc_hs1_ctx->delivery_queue.begin()+count, std::back_inserter(ngc_hs1_ctx->delivery_polled));
+	ngc_hs1_ctx->delivery_queue.erase(ngc_hs1_ctx->delivery_queue.begin(), ngc_hs1_ctx->delivery_queue.begin()+count);
+
+	for (size_t i = 0; i < count; i++) {
+		const auto& delivery = ngc_hs1_ctx->delivery_polled[i];
+		auto& message = messages[i];
+
+		message.group_number = delivery.group_number;
+		std::copy(delivery.group_key.data.cbegin(), delivery.group_key.data.cend(), message.group_chat_id);
+		std::copy(delivery.peer_key.data.cbegin(), delivery.peer_key.data.cend(), message.peer_public_key);
+		message.peer_online = delivery.peer_id.has_value();
+		message.peer_id = delivery.peer_id.value_or(0);
+		message.type = delivery.msg.type;
+		message.message = reinterpret_cast<const uint8_t*>(delivery.msg.text.data());
+		message.length = delivery.msg.text.size();
+		message.message_id = delivery.msg.msg_id;
+	}
+
+	return count;
+}
+
 // record others msg
 void NGC_HS1_record_message(
 	const Tox *tox,
@@ -349,6 +1951,8 @@ void NGC_HS1_record_message(
 
 	Tox_Message_Type type, const uint8_t *message, size_t length, uint32_t message_id
 ) {
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::RECORD_MESSAGE, group_number, peer_number, uint8_t(type), message_id, _hs1_bytes{message, length});
+
 	if (!ngc_hs1_ctx->options.record_others) {
 		return;
 	}
@@ -357,16 +1961,214 @@ void NGC_HS1_record_message(
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
 	// get peer id
 	NGC_EXT::PeerKey p_id{};
 	{ // TODO: error
-		tox_group_peer_get_public_key(tox, group_number, peer_number, p_id.data.data(), nullptr);
+		_hs1_group_peer_get_public_key(tox, ngc_hs1_ctx, group_number, peer_number, p_id);
+	}
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	_store_message(ngc_hs1_ctx, g_id, p_id, group.peer(p_id), message_id, type, std::string{message, message+length});
+
+	if (!group.behind.empty()) {
+		group.push_queue[p_id].push_back(message_id);
+	}
+}
+
+bool NGC_HS1_get_digest(
+	const Tox *tox,
+	NGC_HS1* ngc_hs1_ctx,
+
+	uint32_t group_number,
+	const uint8_t* peer_public_key,
+
+	uint8_t* digest
+) {
+	assert(ngc_hs1_ctx);
+	assert(peer_public_key);
+	assert(digest);
+
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	NGC_EXT::PeerKey p_key;
+	std::copy(peer_public_key, peer_public_key+p_key.size(), p_key.data.begin());
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	auto peer_it = group.peers.find(p_key);
+	if (peer_it == group.peers.end()) {
+		return false;
+	}
+
+	const auto root = peer_it->second.get_digest().root();
+	std::copy(root.cbegin(), root.cend(), digest);
+
+	return true;
+}
+
+size_t NGC_HS1_query_messages(
+	const Tox *tox,
+	NGC_HS1* ngc_hs1_ctx,
+
+	uint32_t group_number,
+
+	const char* keywords,
+	const uint8_t* author_public_key,
+	uint64_t time_from, uint64_t time_to,
+
+	uint32_t* msg_ids_out,
+	uint8_t* authors_out,
+	size_t msg_ids_max
+) {
+	assert(ngc_hs1_ctx);
+
+	if (!ngc_hs1_ctx->options.query_index) {
+		fprintf(stderr, "HS: query without query_index enabled\n");
+		return 0;
+	}
+
+	if (msg_ids_out == nullptr || msg_ids_max == 0) {
+		return 0;
+	}
+
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+
+	if (time_to == 0) {
+		time_to = UINT64_MAX;
+	}
+
+	const auto words = keywords != nullptr ? _hs1_split_words(keywords, std::strlen(keywords)) : std::set<std::string>{};
+
+	struct Result {
+		size_t hits;
+		uint64_t timestamp;
+		const NGC_EXT::PeerKey* peer_key;
+		uint32_t msg_id;
+	};
+	std::vector<Result> results;
+
+	// evicted peers are queried without loading them
+	const auto query_peer = [&](const NGC_EXT::PeerKey& peer_key, NGC_HS1::Peer& peer) {
+		const auto& index = peer.get_index();
+
+		if (words.empty()) {
+			for (auto it = index.by_time.lower_bound(time_from); it != index.by_time.end() && it->first <= time_to; it++) {
+				results.push_back({0, it->first, &peer_key, it->second});
+			}
+			return;
+		}
+
+		std::map<uint32_t, size_t> hits;
+		for (const auto& word : words) {
+			auto w_it = index.words.find(word);
+			if (w_it == index.words.end()) {
+				continue;
+			}
+			for (const uint32_t msg_id : w_it->second) {
+				hits[msg_id]++;
+			}
+		}
+
+		for (const auto& [msg_id, hit_count] : hits) {
+			const uint64_t timestamp = index.timestamps.at(msg_id);
+			if (timestamp < time_from || timestamp > time_to) {
+				continue;
+			}
+			results.push_back({hit_count, timestamp, &peer_key, msg_id});
+		}
+	};
+
+	if (author_public_key != nullptr) {
+		NGC_EXT::PeerKey p_key;
+		std::copy(author_public_key, author_public_key+p_key.size(), p_key.data.begin());
+
+		auto p_it = group.peers.find(p_key);
+		if (p_it == group.peers.end()) {
+			return 0;
+		}
+		query_peer(p_it->first, p_it->second);
+	} else {
+		for (auto& [peer_key, peer] : group.peers) {
+			query_peer(peer_key, peer);
+		}
+	}
+
+	const size_t count = std::min(results.size(), msg_ids_max);
+	std::partial_sort(results.begin(), results.begin()+count, results.end(), [](const Result& lhs, const Result& rhs) {
+		if (lhs.hits != rhs.hits) {
+			return lhs.hits > rhs.hits;
+		}
+		return lhs.timestamp > rhs.timestamp;
+	});
+
+	for (size_t i = 0; i < count; i++) {
+		msg_ids_out[i] = results[i].msg_id;
+		if (authors_out != nullptr) {
+			std::copy(results[i].peer_key->data.cbegin(), results[i].peer_key->data.cend(), authors_out+i*TOX_GROUP_PEER_PUBLIC_KEY_SIZE);
+		}
+	}
+
+	return count;
+}
+
+static constexpr float _hs1_rto_initial {3.f}; // seconds
+static constexpr float _hs1_rto_min {1.f}; // seconds
+
+void NGC_HS1::Group::Link::sample_rtt(float rtt, float max_timeout) {
+	if (!rtt_measured) {
+		srtt = rtt;
+		rttvar = rtt / 2.f;
+		rtt_measured = true;
+	} else {
+		rttvar = 0.75f * rttvar + 0.25f * std::abs(srtt - rtt);
+		srtt = 0.875f * srtt + 0.125f * rtt;
+	}
+
+	rto = std::clamp(srtt + 4.f * rttvar, std::min(_hs1_rto_min, max_timeout), max_timeout);
+}
+
+void NGC_HS1::Group::Link::sample_gap(float gap) {
+	if (!gap_measured) {
+		sgap = gap;
+		gapvar = gap / 2.f;
+		gap_measured = true;
+	} else {
+		gapvar = 0.75f * gapvar + 0.25f * std::abs(sgap - gap);
+		sgap = 0.875f * sgap + 0.125f * gap;
+	}
+}
+
+void NGC_HS1::Group::Link::backoff(float max_timeout) {
+	rto = std::min(rto * 2.f, max_timeout);
+}
+
+float NGC_HS1::Group::Link::transfer_timeout(float max_timeout) const {
+	if (!gap_measured) {
+		return rto;
 	}
 
-	ngc_hs1_ctx->history[g_id].peers[p_id].append(message_id, type, std::string{message, message+length});
+	// slow links get more time, but never less than a round trip
+	return std::min(std::max(rto, sgap + 4.f * gapvar), max_timeout);
+}
+
+NGC_HS1::Group::Link& NGC_HS1::Group::link(uint32_t peer_number, float max_timeout) {
+	auto [it, is_new] = links.try_emplace(peer_number);
+	if (is_new) {
+		it->second.rto = std::min(_hs1_rto_initial, max_timeout);
+	}
+	return it->second;
 }
 
 void _handle_HS1_ft_recv_request(
@@ -378,66 +2180,86 @@ void _handle_HS1_ft_recv_request(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
-	assert(file_id_size == TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t));
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::FT_RECV_REQUEST, group_number, peer_number, _hs1_bytes{file_id, file_id_size});
 
-	// get peer_key from file_id
-	NGC_EXT::PeerKey peer_key;
-	std::copy(file_id, file_id+peer_key.size(), peer_key.data.begin());
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return;
+	}
 
-	// get msg_id from file_id
-	// HACK: little endian
-	uint32_t msg_id;
-	uint8_t* tmp_ptr = reinterpret_cast<uint8_t*>(&msg_id);
-	std::copy(file_id+TOX_GROUP_PEER_PUBLIC_KEY_SIZE, file_id+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t), tmp_ptr);
+	const auto parsed_file_id = _hs1_parse_file_id(file_id, file_id_size);
+	if (!parsed_file_id.has_value()) {
+		fprintf(stderr, "HS: malformed file_id (%zu bytes) from %u\n", file_id_size, peer_number);
+		return;
+	}
+	const auto& [peer_key, msg_id, offset] = parsed_file_id.value();
 
 	fprintf(stderr, "HS: got a ft request for xxx msg_id %08X\n", msg_id);
 
 	// get group id
 	NGC_EXT::GroupKey group_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, group_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, group_id);
 	}
 
-	const auto& peers = ngc_hs1_ctx->history[group_id].peers;
+	auto& group = _get_group(ngc_hs1_ctx, group_id);
 
 	// do we have that message
 
-	if (!peers.count(peer_key)) {
+	auto peer_it = group.peers.find(peer_key);
+	if (peer_it == group.peers.end()) {
 		fprintf(stderr, "HS: got ft request for unknown peer\n");
 		return;
 	}
 
-	const auto& peer = peers.at(peer_key);
-	if (!peer.dict.count(msg_id)) {
+	const auto& peer = peer_it->second;
+	if (!peer.has(msg_id)) {
 		fprintf(stderr, "HS: got ft request for unknown message_id %08X\n", msg_id);
 		return;
 	}
 
+	// catching up
+	_mark_behind(ngc_hs1_ctx, group, peer_number);
+
+	// serve evicted peers from storage, without loading them
+	std::optional<NGC_HS1::Message> msg;
+	if (peer.loaded) {
+		msg = peer.dict.at(msg_id);
+	} else {
+		// has() found it
+		const auto it = std::lower_bound(peer.evicted_ids.cbegin(), peer.evicted_ids.cend(), msg_id);
+		msg = _hs1_storage_read_at(peer.storage_file, peer.evicted_offsets.at(it - peer.evicted_ids.cbegin()), msg_id);
+	}
+
+	if (!msg.has_value()) {
+		fprintf(stderr, "HS: error, message_id %08X missing in storage\n", msg_id);
+		return;
+	}
+
 	// yes we do. now we need to init ft?
 
 	//fprintf(stderr, "TODO: init ft for %08X\n", msg_id);
 
 	// filesize is
 	// - 1 byte msg_type (normal / action)
-	// - x bytes msg_text
+	// - x bytes msg_text (binary, no terminator)
 	// msg_id is part of file_id
-	const auto& msg = peer.dict.at(msg_id);
-	size_t file_size = 1 + msg.text.size();
+	// minus what the remote allready has, if resuming
+	const size_t message_size = 1 + msg->text.size();
+	if (offset >= message_size) {
+		fprintf(stderr, "HS: ft request for %08X with offset %u past the end\n", msg_id, offset);
+		return;
+	}
+	size_t file_size = message_size - offset;
 
 	uint8_t transfer_id {0};
 
-	NGC_FT1_send_init_private(
-		tox, ngc_hs1_ctx->ngc_ft1_ctx,
-		group_number, peer_number,
-		NGC_HS1_MESSAGE_BY_ID,
-		file_id, file_id_size,
-		file_size,
-		&transfer_id
-	);
-
-	//TODO: can fail
+	// echo the file_id, with the offset
+	if (!_hs1_ft_send_init(tox, ngc_hs1_ctx, group_number, peer_number, file_id, file_id_size, file_size, transfer_id)) {
+		fprintf(stderr, "HS: error, failed to init ft for %08X\n", msg_id);
+		return;
+	}
 
-	ngc_hs1_ctx->history[group_id].sending[std::make_pair(peer_number, transfer_id)] = {peer_key, msg_id};
+	group.sending[std::make_pair(peer_number, transfer_id)] = {peer_key, std::move(msg.value()), offset};
 }
 
 bool _handle_HS1_ft_recv_init(
@@ -451,61 +2273,81 @@ bool _handle_HS1_ft_recv_init(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::FT_RECV_INIT, group_number, peer_number, transfer_id, uint64_t(file_size), _hs1_bytes{file_id, file_id_size});
 	//fprintf(stderr, "HS: -------hs handle ft init\n");
 
-	// peer id and msg id from file id
-	// TODO: replace, remote crash
-	assert(file_id_size == TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t));
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return false;
+	}
 
-	// get peer_key from file_id
-	NGC_EXT::PeerKey peer_key;
-	std::copy(file_id, file_id+peer_key.size(), peer_key.data.begin());
+	// peer id and msg id from file id
+	const auto parsed_file_id = _hs1_parse_file_id(file_id, file_id_size);
+	if (!parsed_file_id.has_value()) {
+		fprintf(stderr, "HS: malformed file_id (%zu bytes) from %u\n", file_id_size, peer_number);
+		return false;
+	}
+	const auto& [peer_key, msg_id, offset] = parsed_file_id.value();
 
-	// get msg_id from file_id
-	// HACK: little endian
-	uint32_t msg_id;
-	uint8_t* tmp_ptr = reinterpret_cast<uint8_t*>(&msg_id);
-	std::copy(file_id+TOX_GROUP_PEER_PUBLIC_KEY_SIZE, file_id+TOX_GROUP_PEER_PUBLIC_KEY_SIZE+sizeof(uint32_t), tmp_ptr);
+	// - 1 byte msg_type
+	// - x bytes msg_text
+	// minus offset
+	if (file_size < 1 || offset + file_size > 1+ngc_hs1_ctx->options.max_message_size) {
+		fprintf(stderr, "HS: ft init with bad file_size %zu from %u\n", file_size, peer_number);
+		return false; // deny
+	}
 
 	// did we ask for this?
 
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
-	auto& group = ngc_hs1_ctx->history[g_id];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
 
-	auto& pending = group.peers[peer_key].pending;
-
-	if (!pending.count(msg_id)) {
+	auto fetch_it = group.fetches.find(std::make_pair(peer_key, msg_id));
+	if (fetch_it == group.fetches.end()) {
 		// we did not ask for this
 		// TODO: accept?
 		fprintf(stderr, "HS: ft init from peer we did not ask\n");
 		return false; // deny
 	}
+	auto& fetch = fetch_it->second;
 
-	if (pending.at(msg_id).peer_number != peer_number) {
+	if (fetch.peer_number != peer_number) {
 		// wrong peer ?
 		fprintf(stderr, "HS: ft init from peer we did not ask while asking someone else\n");
 		return false; // deny
 	}
 
-	// TODO: if allready acked but got init again, they did not get the ack
+	const double now = ngc_hs1_ctx->time;
+	if (fetch.state == NGC_HS1::Group::Fetch::State::TRANSFERRING) {
+		// TODO: if allready acked but got init again, they did not get the ack
+		fprintf(stderr, "HS: ft init for a fetch allready transferring, restarting\n");
+		group.transfers.erase(std::make_pair(fetch.peer_number, fetch.transfer_id));
+	} else if (!fetch.retry) {
+		group.link(peer_number, ngc_hs1_ctx->options.ft_activity_timeout).sample_rtt(
+			now - fetch.requested_at,
+			ngc_hs1_ctx->options.ft_activity_timeout
+		);
+	}
+	fetch.last_data_at = now;
 
-	// move from pending to transfers
-	group.transfers[std::make_pair(peer_number, transfer_id)] = {
-		peer_key,
-		msg_id,
-		0.f,
-		{}, // empty buffer
-		file_size,
-	};
+	if (offset != fetch.resume_offset) {
+		// not what we asked for
+		fprintf(stderr, "HS: ft init with offset %u, but we asked for %zu\n", offset, fetch.resume_offset);
+		return false; // deny
+	}
 
-	pending.at(msg_id).time_since_ft_activity = 0.f;
+	fetch.state = NGC_HS1::Group::Fetch::State::TRANSFERRING;
+	fetch.transfer_id = transfer_id;
+	fetch.time_since_ft_activity = 0.f;
+	// drops what a restarted transfer got
+	fetch.recv_buffer.resize(fetch.resume_offset);
+	fetch.file_size = fetch.resume_offset + file_size;
 
-	// keep the pending until later
+	group.transfers[std::make_pair(peer_number, transfer_id)] = fetch_it->first;
 
 	return true; // accept
 }
@@ -521,61 +2363,100 @@ void _handle_HS1_ft_recv_data(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::FT_RECV_DATA, group_number, peer_number, transfer_id, uint64_t(data_offset), _hs1_bytes{data, data_size});
 
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
-	auto& group = ngc_hs1_ctx->history[g_id];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
 
 	// get based on transfer_id
-	if (!group.transfers.count(std::make_pair(peer_number, transfer_id))) {
-		if (data_offset != 0) {
-			fprintf(stderr, "HS: !! got stray tf data from %d tid:%d\n", peer_number, transfer_id);
-			return;
-		}
-
-		// new transfer?
-		fprintf(stderr, "HS: !! got new transfer from %d tid:%d\n", peer_number, transfer_id);
+	auto transfer_it = group.transfers.find(std::make_pair(peer_number, transfer_id));
+	if (transfer_it == group.transfers.end()) {
+		fprintf(stderr, "HS: !! got stray tf data from %d tid:%d\n", peer_number, transfer_id);
+		return;
 	}
+	const auto fetch_key = transfer_it->second;
 
 	fprintf(stderr, "HS: recv_data from %d tid:%d\n", peer_number, transfer_id);
 
-	auto& transfer = group.transfers.at(std::make_pair(peer_number, transfer_id));
-	transfer.time_since_ft_activity = 0.f;
-	// TODO: also timer for pending?
-
-	// TODO: optimize
-	for (size_t i = 0; i < data_size; i++) {
-		transfer.recv_buffer.push_back(data[i]);
+	auto fetch_it = group.fetches.find(fetch_key);
+	if (fetch_it == group.fetches.end()) {
+		fprintf(stderr, "HS: error, transfer %d:%d without fetch\n", peer_number, transfer_id);
+		group.transfers.erase(transfer_it);
+		return;
+	}
+	auto& fetch = fetch_it->second;
+	fetch.time_since_ft_activity = 0.f;
+
+	const double now = ngc_hs1_ctx->time;
+	group.link(peer_number, ngc_hs1_ctx->options.ft_activity_timeout).sample_gap(now - fetch.last_data_at);
+	fetch.last_data_at = now;
+
+	// data_offset is relative to the transfer
+	data_offset += fetch.resume_offset;
+
+	if (data_offset != fetch.recv_buffer.size() || data_offset + data_size > fetch.file_size) {
+		fprintf(stderr, "HS: !! tf data out of order from %d tid:%d\n", peer_number, transfer_id);
+		group.fail_fetch(fetch_key);
+		size_t request_budget = ngc_hs1_ctx->options.max_fetches_per_group;
+		NGC_HS1::Outbox outbox;
+		_fill_fetches(ngc_hs1_ctx, outbox, group_number, group, request_budget);
+		_flush_outbox(tox, ngc_hs1_ctx, outbox);
+		return;
 	}
 
-	// TODO: data done?
-	if (data_offset + data_size == transfer.file_size) {
+	fetch.recv_buffer.insert(fetch.recv_buffer.end(), data, data+data_size);
+
+	if (data_offset + data_size == fetch.file_size) {
 		fprintf(stderr, "HS: transfer done %d:%d\n", peer_number, transfer_id);
-		transfer.recv_buffer.push_back('\0');
-		fprintf(stderr, "    message was %s\n", transfer.recv_buffer.data()+1);
-
-		auto& peer = group.peers[transfer.msg_peer];
-		peer.pending.erase(transfer.msg_id);
-		peer.append(transfer.msg_id, static_cast<Tox_Message_Type>(transfer.recv_buffer.front()), std::string(reinterpret_cast<const char*>(transfer.recv_buffer.data()+1)));
-
-		assert(ngc_hs1_ctx->cb_group_message);
-		// we dont notify if we dont know the peer id. this kinda breaks some stuff
-		if (peer.id.has_value()) {
-			ngc_hs1_ctx->cb_group_message(
-				tox,
-				group_number, peer.id.value(),
-				static_cast<Tox_Message_Type>(transfer.recv_buffer.front()),
-				transfer.recv_buffer.data()+1,
-				transfer.recv_buffer.size()-2,
-				transfer.msg_id
-			);
+		const auto& recv_buffer = fetch.recv_buffer;
+
+		if (recv_buffer.front() != TOX_MESSAGE_TYPE_NORMAL && recv_buffer.front() != TOX_MESSAGE_TYPE_ACTION) {
+			fprintf(stderr, "HS: !! invalid message type %u from %d tid:%d\n", recv_buffer.front(), peer_number, transfer_id);
+			fetch.recv_buffer.clear(); // nothing to resume from
+			group.fail_fetch(fetch_key);
+			size_t request_budget = ngc_hs1_ctx->options.max_fetches_per_group;
+			NGC_HS1::Outbox outbox;
+			_fill_fetches(ngc_hs1_ctx, outbox, group_number, group, request_budget);
+			_flush_outbox(tox, ngc_hs1_ctx, outbox);
+			return;
+		}
+
+		fprintf(stderr, "    message was %zu bytes\n", recv_buffer.size()-1);
+
+		const auto& [msg_peer, msg_id] = fetch_key;
+		auto& peer = group.peer(msg_peer);
+		_store_message(ngc_hs1_ctx, g_id, msg_peer, peer, msg_id, static_cast<Tox_Message_Type>(recv_buffer.front()), std::string(recv_buffer.cbegin()+1, recv_buffer.cend()));
+
+		if (ngc_hs1_ctx->options.delivery_queue_size > 0) {
+			ngc_hs1_ctx->delivery_queue.push_back({group_number, g_id, msg_peer, peer.id, peer.dict.at(msg_id)});
+		} else {
+			assert(ngc_hs1_ctx->cb_group_message);
+			// we dont notify if we dont know the peer id. this kinda breaks some stuff
+			if (peer.id.has_value()) {
+				ngc_hs1_ctx->cb_group_message(
+					tox,
+					group_number, peer.id.value(),
+					static_cast<Tox_Message_Type>(recv_buffer.front()),
+					recv_buffer.data()+1,
+					recv_buffer.size()-1,
+					msg_id
+				);
+			}
 		}
 
-		group.transfers.erase(std::make_pair(peer_number, transfer_id));
+		group.transfers.erase(transfer_it);
+		group.fetches.erase(fetch_key);
+
+		// next one right away
+		size_t request_budget = ngc_hs1_ctx->options.max_fetches_per_group;
+		NGC_HS1::Outbox outbox;
+		_fill_fetches(ngc_hs1_ctx, outbox, group_number, group, request_budget);
+		_flush_outbox(tox, ngc_hs1_ctx, outbox);
 	}
 }
 
@@ -591,38 +2472,38 @@ void _handle_HS1_ft_send_data(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::FT_SEND_DATA, group_number, peer_number, transfer_id, uint64_t(data_offset), uint64_t(data_size));
 
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
-	auto& group = ngc_hs1_ctx->history[g_id];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
 
 	if (!group.sending.count(std::make_pair(peer_number, transfer_id))) {
 		fprintf(stderr, "HS: error, unknown sending transfer %d:%d\n", peer_number, transfer_id);
 		return;
 	}
 
-	// map peer_number and transfer_id to peer_key and message_id
-	const auto& [msg_peer, msg_id] = group.sending.at(std::make_pair(peer_number, transfer_id));
-
-	// get msg
-	const auto& message = group.peers.at(msg_peer).dict.at(msg_id);
+	// map peer_number and transfer_id to the message
+	const auto& sending = group.sending.at(std::make_pair(peer_number, transfer_id));
+	const auto& message = sending.msg;
 
-	size_t data_i = 0;
-	if (data_offset == 0) {
-		// serl type
-		data[data_i++] = message.type;
-		data_offset += 1;
+	// in the message, not the transfer
+	const size_t begin = sending.offset + data_offset;
+	if (begin + data_size > 1 + message.text.size()) {
+		fprintf(stderr, "HS: error, send_data past the end %d:%d\n", peer_number, transfer_id);
+		return;
 	}
 
-	for (size_t i = 0; data_i < data_size; i++, data_i++) {
-		data[data_i] = message.text.at(data_offset+i-1);
+	for (size_t i = 0; i < data_size; i++) {
+		// serl type, then the text
+		data[i] = begin+i == 0 ? static_cast<uint8_t>(message.type) : static_cast<uint8_t>(message.text[begin+i-1]);
 	}
 
-	if (data_offset + data_size == 1 + message.text.size()) {
+	if (begin + data_size == 1 + message.text.size()) {
 		// done
 		fprintf(stderr, "HS: done %d:%d\n", peer_number, transfer_id);
 		group.sending.erase(std::make_pair(peer_number, transfer_id));
@@ -644,6 +2525,12 @@ void _handle_HS1_REQUEST_LAST_IDS(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::CUSTOM_PACKET, group_number, peer_number, uint8_t(NGC_EXT::HS1_REQUEST_LAST_IDS), _hs1_bytes{data, length});
+
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return;
+	}
+
 	size_t curser = 0;
 
 	NGC_EXT::PeerKey p_key;
@@ -655,24 +2542,29 @@ void _handle_HS1_REQUEST_LAST_IDS(
 	_HS1_HAVE(1, fprintf(stderr, "HS: packet too small, missing count\n"); return)
 	uint8_t last_msg_id_count = data[curser++];
 
+	// older versions dont send it
+	uint8_t capabilities {0};
+	if (length - curser >= 1) {
+		capabilities = data[curser++];
+	}
+
 	//fprintf(stderr, "HS: got request for last %u ids\n", last_msg_id_count);
 
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
-	auto& group = ngc_hs1_ctx->history[g_id];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	group.capabilities[peer_number] = capabilities;
 
 	std::vector<uint32_t> message_ids{};
 
-	if (!group.peers.empty() && group.peers.count(p_key)) {
-		const auto& peer = group.peers.at(p_key);
-		auto rit = peer.order.crbegin();
-		for (size_t c = 0; c < last_msg_id_count && rit != peer.order.crend(); c++, rit++) {
-			message_ids.push_back(*rit);
-		}
+	// does not page the peer in, this comes every query interval
+	auto peer_it = group.peers.find(p_key);
+	if (peer_it != group.peers.end()) {
+		message_ids = peer_it->second.last_ids(last_msg_id_count);
 	}
 
 	// - 1 byte packet id
@@ -703,7 +2595,7 @@ void _handle_HS1_REQUEST_LAST_IDS(
 		packing_curser += sizeof(uint32_t);
 	}
 
-	tox_group_send_custom_private_packet(tox, group_number, peer_number, true, pkg.data(), pkg.size(), nullptr);
+	_hs1_group_send_custom_packet(tox, ngc_hs1_ctx, group_number, peer_number, pkg);
 }
 
 void _handle_HS1_RESPONSE_LAST_IDS(
@@ -719,6 +2611,12 @@ void _handle_HS1_RESPONSE_LAST_IDS(
 ) {
 	assert(user_data);
 	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::CUSTOM_PACKET, group_number, peer_number, uint8_t(NGC_EXT::HS1_RESPONSE_LAST_IDS), _hs1_bytes{data, length});
+
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return;
+	}
+
 	size_t curser = 0;
 
 	NGC_EXT::PeerKey p_key;
@@ -732,24 +2630,46 @@ void _handle_HS1_RESPONSE_LAST_IDS(
 	_HS1_HAVE(1, fprintf(stderr, "HS: packet too small, missing count\n"); return)
 	uint8_t last_msg_id_count = data[curser++];
 
+	if (length - curser != last_msg_id_count*sizeof(uint32_t)) {
+		fprintf(stderr, "HS: malformed response, %u ids in %zu bytes\n", last_msg_id_count, length - curser);
+		return;
+	}
+
 	fprintf(stderr, "HS: got response with last %u ids:\n", last_msg_id_count);
 
-	if (last_msg_id_count == 0) {
+	if (last_msg_id_count == 0 && !ngc_hs1_ctx->options.push_new_ids) {
 		return;
 	}
 
 	// get group id
 	NGC_EXT::GroupKey g_id{};
 	{ // TODO: error
-		tox_group_get_chat_id(tox, group_number, g_id.data.data(), nullptr);
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
 	}
 
 	// get peer
-	auto& peer = ngc_hs1_ctx->history[g_id].peers[p_key];
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	if (last_msg_id_count == 0 && !group.peers.count(p_key)) {
+		// we know nothing of that peer either, dont make up peers for any key sent to us
+		return;
+	}
+	auto& peer = group.peer(p_key);
+
+	const uint16_t peer_index = group.peer_index(peer_number);
+
+	// ids are sorted newest first, so the first one gets the highest priority
+	const uint64_t priority_base = ngc_hs1_ctx->hear_counter += last_msg_id_count;
+
+	// if they dont list our newest and had nothing new for us, they are behind
+	std::optional<uint32_t> our_newest;
+	if (const auto newest = peer.last_ids(1); !newest.empty()) {
+		our_newest = newest.front();
+	}
+	bool they_are_behind = our_newest.has_value();
 
 	//std::vector<uint32_t> message_ids{};
 
-	for (size_t i = 0; i < last_msg_id_count && curser+sizeof(uint32_t) <= length; i++) {
+	for (size_t i = 0; i < last_msg_id_count; i++) {
 		uint32_t msg_id;
 
 		// HACK: little endian
@@ -760,16 +2680,583 @@ void _handle_HS1_RESPONSE_LAST_IDS(
 
 		fprintf(stderr, "  %08X", msg_id);
 
-		if (peer.hear(msg_id, peer_number)) { // <-- the important code is here
+		if (our_newest == msg_id || !peer.has(msg_id)) {
+			they_are_behind = false;
+		}
+
+		if (peer.hear(msg_id, peer_index, priority_base - i, group.time)) { // <-- the important code is here
 			fprintf(stderr, " - NEW");
+			group.queue_fetch(p_key, msg_id, peer.heard_of.at(msg_id).priority);
 		}
 
 		fprintf(stderr, "\n");
 	}
 
-	// TODO: replace, remote crash
-	assert(curser == length);
+	if (they_are_behind) {
+		_mark_behind(ngc_hs1_ctx, group, peer_number);
+	}
+}
+
+// how many differing children of a node we look into per response, the rest waits for the next round
+static constexpr size_t _hs1_digest_max_drill {4};
+
+void _handle_HS1_REQUEST_DIGEST(
+	Tox* tox,
+	NGC_EXT_CTX* ngc_ext_ctx,
+
+	uint32_t group_number,
+	uint32_t peer_number,
+
+	const uint8_t *data,
+	size_t length,
+	void* user_data
+) {
+	assert(user_data);
+	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::CUSTOM_PACKET, group_number, peer_number, uint8_t(NGC_HS1_EXT::HS1_REQUEST_DIGEST), _hs1_bytes{data, length});
+
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return;
+	}
+
+	size_t curser = 0;
+
+	NGC_EXT::PeerKey p_key;
+	_HS1_HAVE(p_key.data.size(), fprintf(stderr, "HS: packet too small, missing pkey\n"); return)
+
+	std::copy(data+curser, data+curser+p_key.data.size(), p_key.data.begin());
+	curser += p_key.data.size();
+
+	_HS1_HAVE(1, fprintf(stderr, "HS: packet too small, missing level\n"); return)
+	const uint8_t level = data[curser++];
+	if (level > NGC_HS1::Digest::bucket_level) {
+		fprintf(stderr, "HS: digest request with invalid level %u\n", level);
+		return;
+	}
+
+	uint16_t prefix;
+	_HS1_HAVE(sizeof(prefix), fprintf(stderr, "HS: packet too small, missing prefix\n"); return)
+	// HACK: little endian
+	std::copy(data+curser, data+curser+sizeof(prefix), reinterpret_cast<uint8_t*>(&prefix));
+	curser += sizeof(prefix);
+	if ((uint32_t(prefix) >> (4*level)) != 0) {
+		fprintf(stderr, "HS: digest request with invalid prefix %04X for level %u\n", prefix, level);
+		return;
+	}
+
+	NGC_HS1::Digest::Hash remote_hash;
+	_HS1_HAVE(remote_hash.size(), fprintf(stderr, "HS: packet too small, missing hash\n"); return)
+	std::copy(data+curser, data+curser+remote_hash.size(), remote_hash.begin());
+	curser += remote_hash.size();
+
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	auto peer_it = group.peers.find(p_key);
+	if (peer_it == group.peers.end()) {
+		return; // we have nothing
+	}
+	auto& peer = peer_it->second;
+	const auto& digest = peer.get_digest();
+
+	if (digest.node(level, prefix) == remote_hash) {
+		return; // in sync
+	}
+
+	std::vector<uint8_t> pkg;
+	pkg.push_back(NGC_HS1_EXT::HS1_RESPONSE_DIGEST);
+	pkg.insert(pkg.end(), p_key.data.cbegin(), p_key.data.cend());
+	pkg.push_back(level);
+	// HACK: little endian
+	pkg.insert(pkg.end(), reinterpret_cast<const uint8_t*>(&prefix), reinterpret_cast<const uint8_t*>(&prefix)+sizeof(prefix));
+
+	if (level < NGC_HS1::Digest::bucket_level) {
+		for (uint16_t i = 0; i < 16; i++) {
+			const auto child = digest.node(level+1, prefix << 4 | i);
+			pkg.insert(pkg.end(), child.cbegin(), child.cend());
+		}
+	} else {
+		// all msg_ids in the bucket, both dict and evicted_ids are sorted
+		const uint32_t first = uint32_t(prefix) << 16;
+		const uint32_t last = first | 0xffff;
+		const auto push_id = [&pkg](uint32_t msg_id) {
+			if (pkg.size() + sizeof(msg_id) > TOX_MAX_CUSTOM_PACKET_SIZE) {
+				return false;
+			}
+			// HACK: little endian
+			pkg.insert(pkg.end(), reinterpret_cast<const uint8_t*>(&msg_id), reinterpret_cast<const uint8_t*>(&msg_id)+sizeof(msg_id));
+			return true;
+		};
+
+		if (peer.loaded) {
+			for (auto it = peer.dict.lower_bound(first); it != peer.dict.end() && it->first <= last && push_id(it->first); it++) {}
+		} else {
+			for (auto it = std::lower_bound(peer.evicted_ids.cbegin(), peer.evicted_ids.cend(), first); it != peer.evicted_ids.cend() && *it <= last && push_id(*it); it++) {}
+		}
+	}
+
+	_hs1_group_send_custom_packet(tox, ngc_hs1_ctx, group_number, peer_number, pkg);
+}
+
+void _handle_HS1_RESPONSE_DIGEST(
+	Tox* tox,
+	NGC_EXT_CTX* ngc_ext_ctx,
+
+	uint32_t group_number,
+	uint32_t peer_number,
+
+	const uint8_t *data,
+	size_t length,
+	void* user_data
+) {
+	assert(user_data);
+	NGC_HS1* ngc_hs1_ctx = static_cast<NGC_HS1*>(user_data);
+	_trace(ngc_hs1_ctx, NGC_HS1::Trace::CUSTOM_PACKET, group_number, peer_number, uint8_t(NGC_HS1_EXT::HS1_RESPONSE_DIGEST), _hs1_bytes{data, length});
+
+	if (!_peer_trusted(tox, ngc_hs1_ctx, group_number, peer_number)) {
+		return;
+	}
+
+	size_t curser = 0;
+
+	NGC_EXT::PeerKey p_key;
+	_HS1_HAVE(p_key.data.size(), fprintf(stderr, "HS: packet too small, missing pkey\n"); return)
+
+	std::copy(data+curser, data+curser+p_key.data.size(), p_key.data.begin());
+	curser += p_key.data.size();
+
+	_HS1_HAVE(1, fprintf(stderr, "HS: packet too small, missing level\n"); return)
+	const uint8_t level = data[curser++];
+	if (level > NGC_HS1::Digest::bucket_level) {
+		fprintf(stderr, "HS: digest response with invalid level %u\n", level);
+		return;
+	}
+
+	uint16_t prefix;
+	_HS1_HAVE(sizeof(prefix), fprintf(stderr, "HS: packet too small, missing prefix\n"); return)
+	// HACK: little endian
+	std::copy(data+curser, data+curser+sizeof(prefix), reinterpret_cast<uint8_t*>(&prefix));
+	curser += sizeof(prefix);
+	if ((uint32_t(prefix) >> (4*level)) != 0) {
+		fprintf(stderr, "HS: digest response with invalid prefix %04X for level %u\n", prefix, level);
+		return;
+	}
+
+	if (level == NGC_HS1::Digest::bucket_level) {
+		if ((length - curser) % sizeof(uint32_t) != 0) {
+			fprintf(stderr, "HS: malformed digest response, trailing bytes\n");
+			return;
+		}
+		for (size_t i = curser; i < length; i += sizeof(uint32_t)) {
+			uint32_t msg_id;
+			// HACK: little endian
+			std::copy(data+i, data+i+sizeof(msg_id), reinterpret_cast<uint8_t*>(&msg_id));
+			if ((msg_id >> 16) != prefix) {
+				fprintf(stderr, "HS: malformed digest response, msg_id %08X outside of bucket %04X\n", msg_id, prefix);
+				return;
+			}
+		}
+	} else {
+		_HS1_HAVE(16*sizeof(NGC_HS1::Digest::Hash), fprintf(stderr, "HS: packet too small, missing child hashes\n"); return)
+	}
+
+	// get group id
+	NGC_EXT::GroupKey g_id{};
+	{ // TODO: error
+		_hs1_group_get_chat_id(tox, ngc_hs1_ctx, group_number, g_id);
+	}
+
+	auto& group = _get_group(ngc_hs1_ctx, g_id);
+	auto peer_it = group.peers.find(p_key);
+
+	if (level == NGC_HS1::Digest::bucket_level) {
+		if (curser == length && peer_it == group.peers.end()) {
+			// we know nothing of that peer either, dont make up peers for any key sent to us
+			return;
+		}
+		auto& peer = peer_it != group.peers.end() ? peer_it->second : group.peer(p_key);
+
+		// the ids they have in that bucket, hear the ones we are missing
+		// this is old history, so it goes after everything heard from HS1_RESPONSE_LAST_IDS (those start at 1)
+		const uint16_t peer_index = group.peer_index(peer_number);
+		const uint64_t priority = 0;
+		size_t new_count = 0;
+		for (uint32_t msg_id; curser+sizeof(msg_id) <= length; curser += sizeof(msg_id)) {
+			// HACK: little endian
+			std::copy(data+curser, data+curser+sizeof(msg_id), reinterpret_cast<uint8_t*>(&msg_id));
+			if (peer.hear(msg_id, peer_index, priority, group.time)) {
+				group.queue_fetch(p_key, msg_id, peer.heard_of.at(msg_id).priority);
+				new_count++;
+			}
+		}
+		fprintf(stderr, "HS: digest bucket %04X differs, heard %zu new ids\n", prefix, new_count);
+		return;
+	}
+
+	// drill into the children that differ
+	size_t drill_count = 0;
+	for (uint16_t i = 0; i < 16 && drill_count < _hs1_digest_max_drill; i++, curser += sizeof(NGC_HS1::Digest::Hash)) {
+		NGC_HS1::Digest::Hash remote_child;
+		std::copy(data+curser, data+curser+remote_child.size(), remote_child.begin());
+
+		if (remote_child == NGC_HS1::Digest::Hash{}) {
+			continue; // they have nothing there
+		}
+
+		const uint16_t child_prefix = prefix << 4 | i;
+		// a peer we dont know has nothing anywhere
+		const auto child = peer_it != group.peers.end() ? peer_it->second.get_digest().node(level+1, child_prefix) : NGC_HS1::Digest::Hash{};
+		if (child == remote_child) {
+			continue;
+		}
+
+		const auto pkg = _make_digest_request(p_key, level+1, child_prefix, child);
+		_hs1_group_send_custom_packet(tox, ngc_hs1_ctx, group_number, peer_number, pkg);
+		drill_count++;
+	}
 }
 
 #undef _HS1_HAVE
 
+// ========== replay ==========
+
+// bigger events are treated as a broken trace
+static constexpr size_t _hs1_trace_max_event_size {16*1024*1024};
+
+// messages delivered through the callback or polled while replaying
+static thread_local uint64_t _hs1_replay_messages {0};
+
+static void _replay_message_cb(Tox*, uint32_t, uint32_t, Tox_Message_Type, const uint8_t*, size_t, uint32_t) {
+	_hs1_replay_messages++;
+}
+
+template<typename T>
+static bool _trace_get(const std::vector<uint8_t>& payload, size_t& curser, T& value) {
+	if (payload.size() - curser < sizeof(T)) {
+		return false;
+	}
+
+	// HACK: little endian
+	std::copy(payload.cbegin()+curser, payload.cbegin()+curser+sizeof(T), reinterpret_cast<uint8_t*>(&value));
+	curser += sizeof(T);
+	return true;
+}
+
+// the variable size data at the end
+static _hs1_bytes _trace_rest(const std::vector<uint8_t>& payload, size_t curser) {
+	return {payload.data()+curser, payload.size()-curser};
+}
+
+template<typename Key>
+static bool _trace_get_key(const std::vector<uint8_t>& payload, size_t curser, Key& key) {
+	if (payload.size() - curser != key.size()) {
+		return false;
+	}
+
+	std::copy(payload.cbegin()+curser, payload.cend(), key.data.begin());
+	return true;
+}
+
+// takes the answer, for the call that is about to run
+static bool _replay_answer(NGC_HS1* ngc_hs1_ctx, uint8_t event, const std::vector<uint8_t>& payload) {
+	auto& trace = ngc_hs1_ctx->trace;
+
+	size_t curser = 0;
+	uint32_t group_number {0};
+	uint32_t peer_number {0};
+
+	switch (event) {
+		case NGC_HS1::Trace::CONNECTED_GROUPS: {
+			if (payload.size() % sizeof(uint32_t) != 0) {
+				return false;
+			}
+			trace.connected_groups.resize(payload.size() / sizeof(uint32_t));
+			// HACK: little endian
+			std::copy(payload.cbegin(), payload.cend(), reinterpret_cast<uint8_t*>(trace.connected_groups.data()));
+			return true;
+		}
+		case NGC_HS1::Trace::GROUP_CHAT_ID: {
+			NGC_EXT::GroupKey g_id{};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get_key(payload, curser, g_id)) {
+				return false;
+			}
+			trace.chat_ids[group_number] = g_id;
+			return true;
+		}
+		case NGC_HS1::Trace::PEER_PUBLIC_KEY: {
+			NGC_EXT::PeerKey p_id{};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get_key(payload, curser, p_id)) {
+				return false;
+			}
+			trace.peer_keys[uint64_t(group_number) << 32 | peer_number] = p_id;
+			return true;
+		}
+		case NGC_HS1::Trace::PEER_ROLE: {
+			uint8_t role {0xff};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, role)) {
+				return false;
+			}
+			trace.roles[uint64_t(group_number) << 32 | peer_number] = role;
+			return true;
+		}
+		case NGC_HS1::Trace::SELF_PUBLIC_KEY: {
+			NGC_EXT::PeerKey p_id{};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get_key(payload, curser, p_id)) {
+				return false;
+			}
+			trace.self_keys[group_number] = p_id;
+			return true;
+		}
+		case NGC_HS1::Trace::FT_INIT_SENT: {
+			uint8_t ok {0};
+			uint8_t transfer_id {0};
+			if (!_trace_get(payload, curser, ok) || !_trace_get(payload, curser, transfer_id)) {
+				return false;
+			}
+			trace.ft_inits.emplace_back(ok != 0, transfer_id);
+			return true;
+		}
+		default:
+			return true; // newer trace, skip
+	}
+}
+
+static bool _replay_call(NGC_HS1* ngc_hs1_ctx, uint8_t event, const std::vector<uint8_t>& payload) {
+	size_t curser = 0;
+	uint32_t group_number {0};
+	uint32_t peer_number {0};
+	uint8_t transfer_id {0};
+
+	switch (event) {
+		case NGC_HS1::Trace::ITERATE: {
+			if (!_trace_get(payload, curser, ngc_hs1_ctx->trace.replay_time_delta)) {
+				return false;
+			}
+			NGC_HS1_iterate(nullptr, ngc_hs1_ctx);
+			return true;
+		}
+		case NGC_HS1::Trace::CUSTOM_PACKET: {
+			uint8_t packet_id {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, packet_id)) {
+				return false;
+			}
+			const auto [data, length] = _trace_rest(payload, curser);
+			switch (packet_id) {
+				case NGC_EXT::HS1_REQUEST_LAST_IDS:
+					_handle_HS1_REQUEST_LAST_IDS(nullptr, nullptr, group_number, peer_number, data, length, ngc_hs1_ctx);
+					break;
+				case NGC_EXT::HS1_RESPONSE_LAST_IDS:
+					_handle_HS1_RESPONSE_LAST_IDS(nullptr, nullptr, group_number, peer_number, data, length, ngc_hs1_ctx);
+					break;
+				case NGC_HS1_EXT::HS1_REQUEST_DIGEST:
+					_handle_HS1_REQUEST_DIGEST(nullptr, nullptr, group_number, peer_number, data, length, ngc_hs1_ctx);
+					break;
+				case NGC_HS1_EXT::HS1_RESPONSE_DIGEST:
+					_handle_HS1_RESPONSE_DIGEST(nullptr, nullptr, group_number, peer_number, data, length, ngc_hs1_ctx);
+					break;
+				default:
+					break;
+			}
+			return true;
+		}
+		case NGC_HS1::Trace::FT_RECV_REQUEST: {
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number)) {
+				return false;
+			}
+			const auto [file_id, file_id_size] = _trace_rest(payload, curser);
+			_handle_HS1_ft_recv_request(nullptr, group_number, peer_number, file_id, file_id_size, ngc_hs1_ctx);
+			return true;
+		}
+		case NGC_HS1::Trace::FT_RECV_INIT: {
+			uint64_t file_size {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, transfer_id) || !_trace_get(payload, curser, file_size)) {
+				return false;
+			}
+			const auto [file_id, file_id_size] = _trace_rest(payload, curser);
+			_handle_HS1_ft_recv_init(nullptr, group_number, peer_number, file_id, file_id_size, transfer_id, file_size, ngc_hs1_ctx);
+			return true;
+		}
+		case NGC_HS1::Trace::FT_RECV_DATA: {
+			uint64_t data_offset {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, transfer_id) || !_trace_get(payload, curser, data_offset)) {
+				return false;
+			}
+			const auto [data, data_size] = _trace_rest(payload, curser);
+			_handle_HS1_ft_recv_data(nullptr, group_number, peer_number, transfer_id, data_offset, data, data_size, ngc_hs1_ctx);
+			return true;
+		}
+		case NGC_HS1::Trace::FT_SEND_DATA: {
+			uint64_t data_offset {0};
+			uint64_t data_size {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, transfer_id) || !_trace_get(payload, curser, data_offset) || !_trace_get(payload, curser, data_size)) {
+				return false;
+			}
+			if (data_size > _hs1_trace_max_event_size) {
+				return false;
+			}
+			std::vector<uint8_t> data(data_size);
+			_handle_HS1_ft_send_data(nullptr, group_number, peer_number, transfer_id, data_offset, data.data(), data.size(), ngc_hs1_ctx);
+			return true;
+		}
+		case NGC_HS1::Trace::PEER_ONLINE: {
+			uint8_t online {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, online)) {
+				return false;
+			}
+			NGC_HS1_peer_online(nullptr, ngc_hs1_ctx, group_number, peer_number, online != 0);
+			return true;
+		}
+		case NGC_HS1::Trace::RECORD_MESSAGE: {
+			uint8_t type {0};
+			uint32_t msg_id {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, peer_number) || !_trace_get(payload, curser, type) || !_trace_get(payload, curser, msg_id)) {
+				return false;
+			}
+			const auto [message, length] = _trace_rest(payload, curser);
+			NGC_HS1_record_message(nullptr, ngc_hs1_ctx, group_number, peer_number, static_cast<Tox_Message_Type>(type), message, length, msg_id);
+			return true;
+		}
+		case NGC_HS1::Trace::RECORD_OWN_MESSAGE: {
+			uint8_t type {0};
+			uint32_t msg_id {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, type) || !_trace_get(payload, curser, msg_id)) {
+				return false;
+			}
+			const auto [message, length] = _trace_rest(payload, curser);
+			NGC_HS1_record_own_message(nullptr, ngc_hs1_ctx, group_number, static_cast<Tox_Message_Type>(type), message, length, msg_id);
+			return true;
+		}
+		case NGC_HS1::Trace::BOOST_GROUP: {
+			uint8_t boost {0};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, boost)) {
+				return false;
+			}
+			NGC_HS1_boost_group(nullptr, ngc_hs1_ctx, group_number, boost != 0);
+			return true;
+		}
+		case NGC_HS1::Trace::BOOST_PEER: {
+			uint8_t boost {0};
+			NGC_EXT::PeerKey p_key{};
+			if (!_trace_get(payload, curser, group_number) || !_trace_get(payload, curser, boost) || !_trace_get_key(payload, curser, p_key)) {
+				return false;
+			}
+			NGC_HS1_boost_peer(nullptr, ngc_hs1_ctx, group_number, p_key.data.data(), boost != 0);
+			return true;
+		}
+		case NGC_HS1::Trace::POLL_MESSAGES: {
+			uint64_t count {0};
+			if (!_trace_get(payload, curser, count)) {
+				return false;
+			}
+			// take as many as the consumer did, the queue never holds more than it did then
+			std::vector<NGC_HS1_message> messages(std::min<uint64_t>(count, ngc_hs1_ctx->delivery_queue.size()));
+			_hs1_replay_messages += NGC_HS1_poll_messages(ngc_hs1_ctx, messages.data(), messages.size());
+			return true;
+		}
+		default:
+			return true; // newer trace, skip
+	}
+}
+
+bool NGC_HS1_replay_trace(const char* trace_path, const struct NGC_HS1_options* options, struct NGC_HS1_replay_stats* stats) {
+	assert(trace_path);
+	assert(options);
+
+	FILE* file = fopen(trace_path, "rb");
+	if (file == nullptr) {
+		fprintf(stderr, "HS: error, failed to open trace %s\n", trace_path);
+		return false;
+	}
+
+	uint8_t header[5] {};
+	if (fread(header, 1, sizeof(header), file) != sizeof(header) || std::memcmp(header, "HS1T", 4) != 0 || header[4] != 1) {
+		fprintf(stderr, "HS: error, %s is not a version 1 trace\n", trace_path);
+		fclose(file);
+		return false;
+	}
+
+	NGC_HS1_options replay_options = *options;
+	replay_options.trace_path = nullptr; // dont trace the replay
+	replay_options.storage_path = nullptr; // dont touch the real store and write ahead log
+
+	NGC_HS1* ngc_hs1_ctx = NGC_HS1_new(&replay_options);
+	ngc_hs1_ctx->trace.replaying = true;
+	ngc_hs1_ctx->cb_group_message = _replay_message_cb;
+	_hs1_replay_messages = 0;
+
+	NGC_HS1_replay_stats replay_stats {};
+
+	const auto run = [ngc_hs1_ctx, &replay_stats](uint8_t event, const std::vector<uint8_t>& payload) {
+		const auto start = std::chrono::steady_clock::now();
+		const bool ok = _replay_call(ngc_hs1_ctx, event, payload);
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		if (event == NGC_HS1::Trace::ITERATE) {
+			replay_stats.iterates++;
+			replay_stats.iterate_seconds += seconds;
+			replay_stats.iterate_seconds_max = std::max(replay_stats.iterate_seconds_max, seconds);
+		} else {
+			replay_stats.handler_seconds += seconds;
+		}
+
+		return ok;
+	};
+
+	// the answers come after the call that needed them,
+	// so a call only runs once the next call was read
+	bool ok = true;
+	std::optional<std::pair<uint8_t, std::vector<uint8_t>>> pending;
+	while (ok) {
+		uint8_t event {0};
+		uint32_t size {0};
+		if (fread(&event, 1, 1, file) != 1) {
+			break; // end
+		}
+		// HACK: little endian
+		if (fread(&size, sizeof(size), 1, file) != 1 || size > _hs1_trace_max_event_size) {
+			ok = false;
+			break;
+		}
+		std::vector<uint8_t> payload(size);
+		if (size > 0 && fread(payload.data(), 1, size, file) != size) {
+			ok = false;
+			break;
+		}
+
+		replay_stats.events++;
+
+		if (event >= NGC_HS1::Trace::CONNECTED_GROUPS) {
+			ok = _replay_answer(ngc_hs1_ctx, event, payload);
+		} else {
+			if (pending.has_value()) {
+				ok = run(pending->first, pending->second);
+			}
+			pending = std::make_pair(event, std::move(payload));
+		}
+	}
+	if (ok && pending.has_value()) {
+		ok = run(pending->first, pending->second);
+	}
+
+	if (!ok) {
+		fprintf(stderr, "HS: error, broken trace %s after %lu events\n", trace_path, static_cast<unsigned long>(replay_stats.events));
+	}
+
+	replay_stats.packets_sent = ngc_hs1_ctx->trace.replay_packets_sent;
+	replay_stats.bytes_sent = ngc_hs1_ctx->trace.replay_bytes_sent;
+	replay_stats.messages += _hs1_replay_messages;
+
+	NGC_HS1_kill(ngc_hs1_ctx);
+	fclose(file);
+
+	if (stats != nullptr) {
+		*stats = replay_stats;
+	}
+
+	return ok;
+}
+
@@ -27,7 +27,8 @@ struct NGC_HS1_options {
 	// 2 mods
 	// 3 founders
 	// 4 no one (above founder)
-	uint8_t default_trust_level /*= 2*/; // TODO: unused right now
+	// applies to who we serve history to and who we fetch it from
+	uint8_t default_trust_level /*= 2*/;
 
 	// if false, will only record own messages
 	bool record_others;
@@ -38,7 +39,70 @@ struct NGC_HS1_options {
 	size_t last_msg_ids_count; // 5
 
 	// after which the filetransfer is canceled, and potentially restart, with maybe another peer
+	// the timeouts adapt to the measured round trip and chunk times per peer, this is the upper bound
 	float ft_activity_timeout; // seconds 60.f
+
+	// everything below was added later, new fields go at the end
+	// if 0 (eg. zero initialized), they get the default in their comment
+
+	// maintain a keyword and time index over stored messages, required for NGC_HS1_query_messages
+	// with storage_path, the index stays in memory while the messages are evicted
+	bool query_index; // false
+
+	// how many message requests NGC_HS1_iterate can start, over all groups
+	// boosted groups take from it first, the rest is split over the worker_threads shards
+	size_t max_requests_per_iterate; // 8
+
+	// how many messages can be requested/transferring at the same time, per group
+	// a finished or failed fetch immediately starts the next one
+	size_t max_fetches_per_group; // 4
+
+	// if not 0, messages fetched by history sync are queued for NGC_HS1_poll_messages instead of the callback
+	// no new messages get requested while the queue is full (requests in flight can still overshoot it)
+	size_t delivery_queue_size; // 0
+
+	// heard of msg_ids no peer advertised again for this long are forgotten
+	float heard_of_max_age; // seconds 300.f
+
+	// groups are split into this many shards, iterated in parallel by NGC_HS1_iterate
+	// 0 or 1 iterates everything on the calling thread
+	// only iterate is sharded, the packet and ft1 handlers (storing, indexing, hashing, logging) run on the calling thread
+	size_t worker_threads; // 0
+
+	// directory for message storage, NULL keeps all messages in memory
+	// peers with stored messages are only loaded when accessed
+	const char* storage_path; // NULL
+
+	// with storage_path, messages of peers not accessed for this long get written out and dropped from memory,
+	// groups not accessed for this long (eg. left) get dropped completely
+	float evict_after; // seconds 300.f
+
+	// with storage_path, how recorded messages are made durable
+	// 1 only written out on eviction and kill
+	// 2 write ahead log, handed to the os (survives the program crashing)
+	// 3 write ahead log, synced to disk (survives power loss)
+	uint8_t durability; // 2
+
+	// the write ahead log is committed in groups, once either is reached
+	float wal_commit_interval; // seconds 0.05f
+	size_t wal_commit_count; // 1000
+
+	// also compare digests (NGC_HS1_get_digest) with the group every query interval,
+	// drilling down into differing ranges and fetching what we are missing
+	bool digest_sync; // false
+
+	// announce newly recorded messages right away to peers that recently showed they are missing history
+	// (just came online, fetch from us, or are missing our newest msg_id), instead of waiting for their query
+	bool push_new_ids; // false
+	float push_behind_window; // seconds 120.f
+
+	// if set, everything coming in (hs1 packets, ft1 callbacks, iterate timing, peer online, record, boost and poll calls)
+	// and the tox answers it needed get written to this file, for NGC_HS1_replay_trace
+	const char* trace_path; // NULL
+
+	// biggest message fetched from others, bigger transfers are denied
+	// recorded messages are always stored, whatever their size
+	size_t max_message_size; // bytes 16MiB
 };
 
 // ========== init / kill ==========
@@ -56,6 +120,17 @@ void NGC_HS1_iterate(Tox *tox, NGC_HS1* ngc_hs1_ctx);
 
 void NGC_HS1_peer_online(Tox* tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, uint32_t peer_number, bool online);
 
+// ========== priority ==========
+
+// history is fetched newest first, boosted groups before other groups
+// and boosted peers (authors) before other peers of that group
+// eg. boost what the user is currently looking at
+
+void NGC_HS1_boost_group(const Tox *tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, bool boost);
+
+// public_key: TOX_GROUP_PEER_PUBLIC_KEY_SIZE bytes
+void NGC_HS1_boost_peer(const Tox *tox, NGC_HS1* ngc_hs1_ctx, uint32_t group_number, const uint8_t* public_key, bool boost);
+
 // ========== send ==========
 
 // shim
@@ -95,8 +170,28 @@ typedef void NGC_HS1_group_message_cb(
 
 // callback for when history sync has a new message
 // fake tox interface variant that is limited to peers that have been observed since the program started
+// not used if delivery_queue_size is set
 void NGC_HS1_register_callback_group_message(NGC_HS1* ngc_hs1_ctx, NGC_HS1_group_message_cb* callback); // TODO: userdata
 
+struct NGC_HS1_message {
+	uint32_t group_number;
+	uint8_t group_chat_id[TOX_GROUP_CHAT_ID_SIZE];
+
+	uint8_t peer_public_key[TOX_GROUP_PEER_PUBLIC_KEY_SIZE];
+	bool peer_online; // peer_id is only valid if the author was online when the message arrived
+	uint32_t peer_id;
+
+	Tox_Message_Type type;
+	const uint8_t *message; // valid until the next NGC_HS1_poll_messages call
+	size_t length;
+	uint32_t message_id;
+};
+
+// pull variant, requires delivery_queue_size
+// pops up to max_count messages fetched by history sync, in the order they arrived
+// returns the number of messages written to messages
+size_t NGC_HS1_poll_messages(NGC_HS1* ngc_hs1_ctx, struct NGC_HS1_message* messages, size_t max_count);
+
 // record others msg
 void NGC_HS1_record_message(
 	const Tox *tox,
@@ -108,6 +203,68 @@ void NGC_HS1_record_message(
 	Tox_Message_Type type, const uint8_t *message, size_t length, uint32_t message_id
 );
 
+// ========== digest ==========
+
+// root hash over all messages of a peer we have, same root means same history
+// digest: 32 bytes out
+// returns false if we know nothing of that peer
+bool NGC_HS1_get_digest(
+	const Tox *tox,
+	NGC_HS1* ngc_hs1_ctx,
+
+	uint32_t group_number,
+	const uint8_t* peer_public_key,
+
+	uint8_t* digest
+);
+
+// ========== query ==========
+
+// search the stored history of a group, requires query_index
+// keywords: words, matched whole and case insensitive (ascii), NULL or "" to match every message
+//   anything that is not an ascii letter or digit separates words (eg. "don't" is "don" and "t"), other utf8 bytes are part of words
+// author_public_key: TOX_GROUP_PEER_PUBLIC_KEY_SIZE bytes, NULL for any author
+// time_from/time_to: inclusive unix time window of when the message was stored, 0 for open ended
+// results are ranked by number of matched keywords, then newest first
+// authors_out: optional, room for msg_ids_max * TOX_GROUP_PEER_PUBLIC_KEY_SIZE bytes, the author of each msg_id
+// returns the number of results written
+size_t NGC_HS1_query_messages(
+	const Tox *tox,
+	NGC_HS1* ngc_hs1_ctx,
+
+	uint32_t group_number,
+
+	const char* keywords,
+	const uint8_t* author_public_key,
+	uint64_t time_from, uint64_t time_to,
+
+	uint32_t* msg_ids_out,
+	uint8_t* authors_out,
+	size_t msg_ids_max
+);
+
+// ========== trace ==========
+
+struct NGC_HS1_replay_stats {
+	uint64_t events;
+	uint64_t iterates;
+	double iterate_seconds; // wall time spent in NGC_HS1_iterate
+	double iterate_seconds_max;
+	double handler_seconds; // wall time spent in everything else
+	uint64_t packets_sent; // custom packets, dropped
+	uint64_t bytes_sent;
+	uint64_t messages; // fetched messages delivered
+};
+
+// feeds a trace recorded with options.trace_path into a fresh NGC_HS1 made with options, as fast as possible
+// no tox or ft1 is needed, the tox answers come from the trace and everything sent gets dropped
+// all timers (intervals, timeouts, round trip times) run on the recorded iterate times,
+// and boosts and polls happen where they were recorded (polling as many as the caller took), so the replay takes the same path
+// options.storage_path is ignored, the replay keeps everything in memory
+// stats: optional
+// returns false if the trace could not be read (completely)
+bool NGC_HS1_replay_trace(const char* trace_path, const struct NGC_HS1_options* options, struct NGC_HS1_replay_stats* stats);
+
 #ifdef __cplusplus
 }
 #endif
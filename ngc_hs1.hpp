@@ -5,11 +5,52 @@
 #include "ngc_ext.hpp"
 
 #include <cstdint>
+#include <array>
 #include <map>
 #include <list>
+#include <deque>
 #include <set>
+#include <unordered_map>
 #include <vector>
+#include <string>
 #include <optional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdio>
+
+// TODO: move into NGC_EXT::PacketType
+namespace NGC_HS1_EXT {
+	enum PacketType : uint8_t {
+		// compare a node of the digest tree of a peer
+		// - peer_key bytes (the msg_ids are from)
+		// - 1 byte level (0 is the root)
+		// - 2 bytes prefix (msg_id bits above the level)
+		// - 32 bytes node hash
+		HS1_REQUEST_DIGEST = 3u,
+
+		// only sent if the node hash differs
+		// - peer_key bytes
+		// - 1 byte level
+		// - 2 bytes prefix
+		// - level < bucket level:
+		//   - 16 * 32 bytes child node hashes
+		// - level == bucket level:
+		//   - array [
+		//     - msg_id bytes (all (that fit) msg_ids in the bucket)
+		//   - ]
+		HS1_RESPONSE_DIGEST,
+	};
+
+	// what a peer understands, as 1 byte of flags after the count in its NGC_EXT::HS1_REQUEST_LAST_IDS
+	// older versions dont send it, and ignore it
+	enum Capability : uint8_t {
+		// the resume offset in the file_id of NGC_HS1_MESSAGE_BY_ID
+		HS1_CAP_RESUME = 1u << 0,
+	};
+} // NGC_HS1_EXT
 
 struct NGC_HS1 {
 	NGC_HS1_options options;
@@ -25,6 +66,40 @@ struct NGC_HS1 {
 		uint32_t msg_id{};
 		Tox_Message_Type type{};
 		std::string text{};
+		uint64_t timestamp{}; // unix time when we stored it
+	};
+
+	// small set of dense peer indices (see Group::peer_index), inline up to 64
+	struct PeerSet {
+		uint64_t bits {0};
+		std::vector<uint16_t> overflow; // indices >= 64, usually empty
+
+		// returns false if allready in
+		bool insert(uint16_t index);
+		void erase(uint16_t index);
+		bool empty(void) const;
+		size_t size(void) const;
+		// in index order, nullopt if n >= size()
+		std::optional<uint16_t> nth(size_t n) const;
+	};
+
+	// range hash tree over the messages of a peer, for cheap consistency checks
+	// 16-ary over the upper 16 bits of the msg_id, the buckets (last level) xor the message hashes,
+	// so it does not depend on the order we got the messages in
+	struct Digest {
+		using Hash = std::array<uint8_t, 32>;
+		static constexpr uint8_t bucket_level {4};
+
+		// key: level << 16 | prefix, missing nodes are all zero
+		std::unordered_map<uint32_t, Hash> nodes;
+
+		static Hash message_hash(const Message& msg);
+
+		// xors the message hash in or out of its bucket and updates the path to the root
+		void toggle(uint32_t msg_id, const Hash& msg_hash);
+
+		Hash node(uint8_t level, uint16_t prefix) const;
+		Hash root(void) const { return node(0, 0); }
 	};
 
 	struct Peer {
@@ -32,45 +107,327 @@ struct NGC_HS1 {
 		std::map<uint32_t, Message> dict;
 		std::list<uint32_t> order; // ordered list of message ids
 
-		// msg_ids we have only heard of, with peer_number of who we heard it from
-		std::map<uint32_t, std::set<uint32_t>> heard_of;
+		// paging, only with options.storage_path
+		// the file is an append log mirroring order, messages are only in memory while loaded
+		std::string storage_file; // empty if no storage
+		bool loaded {true};
+		size_t stored_count {0}; // how much of order is in the file
+		std::vector<uint32_t> evicted_ids; // sorted, what dict had when evicted
+		std::vector<uint64_t> evicted_offsets; // same order as evicted_ids, where the latest record of that id starts in the file
+		std::vector<uint32_t> evicted_last_ids; // the end of order, oldest first, so requests for the last ids dont load
+		static constexpr size_t evicted_last_ids_max {UINT8_MAX}; // count in HS1_REQUEST_LAST_IDS is one byte
+		float time_since_access {0.f};
 
-		struct PendingFTRequest {
-			uint32_t peer_number; // the peer we requested the message from
-			float time_since_ft_activity {0.f};
+		// only maintained if options.query_index is set
+		// kept while evicted, use get_index()
+		struct QueryIndex {
+			std::map<std::string, std::set<uint32_t>> words; // word -> msg_ids
+			std::multimap<uint64_t, uint32_t> by_time; // timestamp -> msg_id
+			std::unordered_map<uint32_t, uint64_t> timestamps; // msg_id -> timestamp, to rank keyword hits without the message
+
+			void add(const Message& msg);
+			void remove(const Message& msg);
+		} index;
+		bool index_built {true}; // false for peers found in storage, until a query needs it
+
+		// kept while evicted, use get_digest()
+		Digest digest;
+		bool digest_built {true}; // false for peers found in storage, until the digest is needed
+
+		// msg_ids we have only heard of, with who we heard it from
+		struct HeardOf {
+			PeerSet sources;
+			uint64_t priority {0}; // higher is newer, set when first heard, 0 if found by digest sync
+			float last_heard {0.f}; // Group::time, for aging
+			uint8_t fetch_attempts {0}; // also picks the source, each try asks the next one
+			std::vector<uint8_t> partial; // received bytes of a failed fetch, to resume from
 		};
-		std::map<uint32_t, PendingFTRequest> pending; // key msg_id
+		std::unordered_map<uint32_t, HeardOf> heard_of;
 
 		// dont start immediatly
 		float time_since_last_request_sent {0.f};
 
-		void append(uint32_t msg_id, Tox_Message_Type type, const std::string& text);
+		void append(uint32_t msg_id, Tox_Message_Type type, const std::string& text, bool update_index);
+
+		// adds to dict, order and index, without logging
+		void store(Message&& msg, bool update_index);
+
+		// works loaded or not
+		bool has(uint32_t msg_id) const;
+		// newest first, works loaded or not
+		std::vector<uint32_t> last_ids(size_t count) const;
+
+		// pages the messages in if needed and resets the eviction timer
+		void load(bool update_index);
+		// writes messages not yet in the file
+		void flush(bool sync);
+		// flushes and drops the messages from memory
+		void evict(bool sync);
+		// reads the evicted_ data from the file, without the texts
+		void read_evicted(void);
+
+		// builds the digest from storage first if needed, without loading the peer
+		const Digest& get_digest(void);
+		// same for the query index
+		const QueryIndex& get_index(void);
 
 		// returns if new (from that peer)
-		bool hear(uint32_t msg_id, uint32_t peer_number);
+		bool hear(uint32_t msg_id, uint16_t peer_index, uint64_t priority, float now);
 	};
 
 	struct Group {
 		std::map<NGC_EXT::PeerKey, Peer> peers;
 
-		struct FileTransfers {
+		// empty if no storage
+		std::string storage_dir;
+		// reset by _get_group, groups not accessed for evict_after get paged out with all their peers
+		float time_since_access {0.f};
+
+		// use this over peers[], sets up storage for new peers
+		Peer& peer(const NGC_EXT::PeerKey& peer_key);
+
+		// seconds, advanced by iterate
+		float time {0.f};
+		float time_since_heard_of_sweep {0.f};
+
+		// remote peer_numbers remapped to dense indices, freed indices get reused
+		std::unordered_map<uint32_t, uint16_t> peer_number_to_index;
+		std::vector<std::optional<uint32_t>> index_to_peer_number;
+
+		// allocates an index if the peer_number has none
+		uint16_t peer_index(uint32_t peer_number);
+		// forgets everything heard from that peer_number and frees its index
+		void release_peer_index(uint32_t peer_number);
+
+		// heard_of msg_ids waiting to be requested, best first
+		// entries can be stale (message arrived, allready fetching), they get dropped when reached
+		struct FetchQueueEntry {
+			bool boosted {false};
+			uint64_t priority {0};
 			NGC_EXT::PeerKey msg_peer;
 			uint32_t msg_id;
+
+			bool operator<(const FetchQueueEntry& rhs) const;
+		};
+		std::set<FetchQueueEntry> fetch_queue;
+
+		// eg. the group/peer the user is looking at
+		bool boosted {false};
+		std::set<NGC_EXT::PeerKey> boosted_peers;
+
+		void queue_fetch(const NGC_EXT::PeerKey& msg_peer, uint32_t msg_id, uint64_t priority);
+
+		// drops the fetch and puts it back into the queue
+		void fail_fetch(const std::pair<NGC_EXT::PeerKey, uint32_t>& key);
+
+		// a message we are fetching, from request until the transfer completed or failed
+		struct Fetch {
+			enum class State {
+				REQUESTED, // waiting for the remote to init the ft
+				TRANSFERRING,
+			} state {State::REQUESTED};
+
+			uint32_t peer_number; // the peer we requested the message from
+			uint8_t transfer_id {0}; // only when TRANSFERRING
 			float time_since_ft_activity {0.f};
-			std::vector<uint8_t> recv_buffer; // message gets dumped into here
-			size_t file_size {0};
+			bool retry {false}; // requested before, so no rtt sample (karn)
+			double requested_at {0.0}; // NGC_HS1::time
+			double last_data_at {0.0}; // or init
+			std::vector<uint8_t> recv_buffer; // message gets dumped into here, can start with a resumed part
+			size_t resume_offset {0}; // where the transfer starts in the message, as requested
+			size_t file_size {0}; // of the whole message
 		};
+		// key: msg peer_key + msg_id
+		std::map<std::pair<NGC_EXT::PeerKey, uint32_t>, Fetch> fetches;
+
 		// key: peer_number + transfer_id
-		std::map<std::pair<uint32_t, uint8_t>, FileTransfers> transfers;
+		// value: key into fetches
+		std::map<std::pair<uint32_t, uint8_t>, std::pair<NGC_EXT::PeerKey, uint32_t>> transfers;
+
+		// timing of a remote peer_number, for the fetch timeouts
+		// like the tcp rto (rfc 6298), plus the same smoothing for chunk inter-arrival times
+		struct Link {
+			float srtt {0.f};
+			float rttvar {0.f};
+			float rto {0.f};
+			bool rtt_measured {false};
+
+			float sgap {0.f};
+			float gapvar {0.f};
+			bool gap_measured {false};
+
+			// request to ft init
+			void sample_rtt(float rtt, float max_timeout);
+			// between chunks of a transfer
+			void sample_gap(float gap);
+			// on timeout, doubles the rto
+			void backoff(float max_timeout);
+
+			float transfer_timeout(float max_timeout) const;
+		};
+		std::unordered_map<uint32_t, Link> links;
+
+		// creates with the initial rto
+		Link& link(uint32_t peer_number, float max_timeout);
 
 		struct Sending {
 			NGC_EXT::PeerKey msg_peer;
-			uint32_t msg_id;
+			Message msg; // copy, the peer might get evicted while sending
+			size_t offset {0}; // resumed transfers skip what the remote has
 		};
 		std::map<std::pair<uint32_t, uint8_t>, Sending> sending;
+
+		// remote peer_numbers, from the flags in their HS1_REQUEST_LAST_IDS
+		std::unordered_map<uint32_t, uint8_t> capabilities;
+
+		// only with options.push_new_ids
+		// remote peer_numbers that are missing history, value: Group::time until which they count as behind
+		std::unordered_map<uint32_t, float> behind;
+		// newly recorded msg_ids per author, oldest first, pushed (batched) by iterate
+		std::map<NGC_EXT::PeerKey, std::vector<uint32_t>> push_queue;
 	};
 
 	std::map<NGC_EXT::GroupKey, Group> history;
+
+	// empty if everything is kept in memory
+	std::string storage_path;
+
+	// write ahead log for recorded messages, with group commit
+	// only open with storage_path and durability >= 2
+	// record: group key, peer key, storage record
+	FILE* wal_file {nullptr};
+	std::vector<uint8_t> wal_buffer; // records not yet committed
+	size_t wal_buffer_count {0};
+	size_t wal_size {0}; // bytes committed since the last checkpoint
+	double wal_last_commit {0.0}; // NGC_HS1::time
+
+	// fetched messages waiting for NGC_HS1_poll_messages
+	struct Delivery {
+		uint32_t group_number;
+		NGC_EXT::GroupKey group_key;
+		NGC_EXT::PeerKey peer_key;
+		std::optional<uint32_t> peer_id;
+		Message msg;
+	};
+	std::deque<Delivery> delivery_queue;
+	std::vector<Delivery> delivery_polled; // keeps the texts of the last poll alive
+
+	// trust level (see options.default_trust_level) of remote peers, from their group role
+	// key: group_number << 32 | peer_number
+	// dropped on peer_online, and expire, since roles can change
+	struct CachedTrust {
+		uint8_t level {0};
+		double checked {0.0}; // NGC_HS1::time
+	};
+	std::unordered_map<uint64_t, CachedTrust> trust_cache;
+	double trust_cache_last_prune {0.0};
+
+	// for the iterate delta time
+	std::chrono::steady_clock::time_point last_iterate;
+
+	// seconds, advanced by iterate (by the recorded deltas when replaying), everything timed uses this
+	// so a replay takes the same decisions as the recording
+	double time {0.0};
+
+	// capture of everything coming in, see options.trace_path, and the state to replay one
+	// file:
+	// - 4 bytes "HS1T"
+	// - 1 byte version
+	// - array [
+	//   - 1 byte event
+	//   - 4 bytes payload size
+	//   - payload (fields below, variable size data is last and takes the rest)
+	// - ]
+	struct Trace {
+		enum Event : uint8_t {
+			// calls into NGC_HS1, these get replayed
+			ITERATE = 1u, // f32 time_delta
+			CUSTOM_PACKET, // u32 group_number, u32 peer_number, u8 packet id, data
+			FT_RECV_REQUEST, // u32 group_number, u32 peer_number, file_id
+			FT_RECV_INIT, // u32 group_number, u32 peer_number, u8 transfer_id, u64 file_size, file_id
+			FT_RECV_DATA, // u32 group_number, u32 peer_number, u8 transfer_id, u64 data_offset, data
+			FT_SEND_DATA, // u32 group_number, u32 peer_number, u8 transfer_id, u64 data_offset, u64 data_size
+			PEER_ONLINE, // u32 group_number, u32 peer_number, u8 online
+			RECORD_MESSAGE, // u32 group_number, u32 peer_number, u8 type, u32 msg_id, message
+			RECORD_OWN_MESSAGE, // u32 group_number, u8 type, u32 msg_id, message
+			BOOST_GROUP, // u32 group_number, u8 boost
+			BOOST_PEER, // u32 group_number, u8 boost, public_key
+			POLL_MESSAGES, // u64 count taken
+
+			// answers from tox/ft1, for the call before them
+			// only written when they changed
+			CONNECTED_GROUPS = 64u, // u32 group_numbers
+			GROUP_CHAT_ID, // u32 group_number, chat_id
+			PEER_PUBLIC_KEY, // u32 group_number, u32 peer_number, public_key
+			PEER_ROLE, // u32 group_number, u32 peer_number, u8 role (0xff if not found), always written
+			SELF_PUBLIC_KEY, // u32 group_number, public_key
+			FT_INIT_SENT, // u8 ok, u8 transfer_id, always written
+		};
+
+		FILE* file {nullptr};
+		std::vector<uint8_t> buffer; // written out every iterate
+
+		// the answers, as last written or replayed
+		std::vector<uint32_t> connected_groups;
+		std::unordered_map<uint32_t, NGC_EXT::GroupKey> chat_ids;
+		std::unordered_map<uint64_t, NGC_EXT::PeerKey> peer_keys; // group_number << 32 | peer_number
+		std::unordered_map<uint64_t, uint8_t> roles; // only replay
+		std::unordered_map<uint32_t, NGC_EXT::PeerKey> self_keys;
+		std::deque<std::pair<bool, uint8_t>> ft_inits; // only replay
+
+		bool replaying {false};
+		float replay_time_delta {0.f};
+		uint64_t replay_packets_sent {0};
+		uint64_t replay_bytes_sent {0};
+	} trace;
+
+	// source for fetch priorities, ids heard later are newer
+	uint64_t hear_counter {0};
+
+	// tox and ft1 calls made by code that can run on a shard worker
+	// they get sent from the thread calling into NGC_HS1
+	struct Outbox {
+		struct CustomPacket {
+			uint32_t group_number;
+			std::vector<uint8_t> data;
+			std::optional<uint32_t> peer_number {}; // private if set, otherwise to the whole group
+		};
+		std::vector<CustomPacket> custom_packets;
+
+		struct FTRequest {
+			uint32_t group_number;
+			uint32_t peer_number;
+			std::vector<uint8_t> file_id;
+		};
+		std::vector<FTRequest> ft_requests;
+	};
+
+	// each group is owned by one shard (by group key), shards get iterated in parallel
+	// boosted groups are not in any shard, iterate runs them first
+	// handlers still run on the tox thread, while no shard is running
+	struct Shard {
+		std::vector<std::pair<uint32_t, Group*>> groups; // refilled every iterate
+		size_t request_budget {0};
+		Outbox outbox;
+	};
+	std::vector<Shard> shards;
+
+	// shard 0 runs on the calling thread, shard i on workers[i-1]
+	struct Workers {
+		std::vector<std::thread> threads;
+		std::mutex mutex;
+		std::condition_variable cv_start;
+		std::condition_variable cv_done;
+		std::function<void(size_t)> job; // gets the shard index
+		uint64_t generation {0};
+		size_t running {0};
+		bool quit {false};
+
+		void start(size_t count);
+		// runs job for every shard, returns when all are done
+		void run(const std::function<void(size_t)>& fn);
+		void stop(void);
+	} workers;
 };
 
 void _handle_HS1_REQUEST_LAST_IDS(
@@ -97,6 +454,30 @@ void _handle_HS1_RESPONSE_LAST_IDS(
 	void* user_data
 );
 
+void _handle_HS1_REQUEST_DIGEST(
+	Tox* tox,
+	NGC_EXT_CTX* ngc_ext_ctx,
+
+	uint32_t group_number,
+	uint32_t peer_number,
+
+	const uint8_t *data,
+	size_t length,
+	void* user_data
+);
+
+void _handle_HS1_RESPONSE_DIGEST(
+	Tox* tox,
+	NGC_EXT_CTX* ngc_ext_ctx,
+
+	uint32_t group_number,
+	uint32_t peer_number,
+
+	const uint8_t *data,
+	size_t length,
+	void* user_data
+);
+
 void _handle_HS1_ft_request_message(
 	Tox *tox, NGC_EXT_CTX* ngc_ext_ctx,
 	uint32_t group_number,
@@ -113,3 +494,42 @@ bool _handle_HS1_ft_init_message(
 	const size_t file_size
 );
 
+// ft1 callbacks of NGC_HS1_MESSAGE_BY_ID
+void _handle_HS1_ft_recv_request(
+	Tox *tox,
+	uint32_t group_number,
+	uint32_t peer_number,
+	const uint8_t* file_id, size_t file_id_size,
+	void* user_data
+);
+
+bool _handle_HS1_ft_recv_init(
+	Tox *tox,
+	uint32_t group_number,
+	uint32_t peer_number,
+	const uint8_t* file_id, size_t file_id_size,
+	const uint8_t transfer_id,
+	const size_t file_size,
+	void* user_data
+);
+
+void _handle_HS1_ft_recv_data(
+	Tox *tox,
+	uint32_t group_number,
+	uint32_t peer_number,
+	uint8_t transfer_id,
+	size_t data_offset,
+	const uint8_t* data, size_t data_size,
+	void* user_data
+);
+
+void _handle_HS1_ft_send_data(
+	Tox *tox,
+
+	uint32_t group_number,
+	uint32_t peer_number,
+	uint8_t transfer_id,
+
+	size_t data_offset, uint8_t* data, size_t data_size,
+	void* user_data
+);